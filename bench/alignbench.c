@@ -0,0 +1,229 @@
+/*
+ * Alignment benchmark with synthetic subtitles and lattices, no decoder.
+ *
+ * Build from the repository root:
+ *   cc -std=gnu11 -O2 -pthread -Isrc -o alignbench bench/alignbench.c \
+ *       src/alignment.c src/alloc.c src/subwords.c src/dict.c \
+ *       src/srcdict.c src/hashtable.c src/text.c src/common.c -lm
+ *
+ * Link src/alignment_wide.c instead of src/alignment.c for the 8-way tree.
+ *
+ * The subtitles are `-n` words drawn from a vocabulary of `-v` words with
+ * Zipf exponent `-z`, 8 words per cue of 2.4 s. Each of the `-l` lattices
+ * covers the next `-d` subtitle words: one column of `-b` nodes per word,
+ * fully linked to the next column. One node of a column has the subtitle
+ * word, unless it is replaced with a random one (word error rate `-e`),
+ * the others are random words.
+ */
+#include "common.h"
+
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+
+#include "alignment.h"
+#include "dict.h"
+#include "lattice.h"
+#include "subwords.h"
+
+#define CUEWORDS 8
+#define WORDTIME 300 // ms
+
+struct options {
+    unsigned nwords;
+    unsigned vocabsize;
+    double zipf;
+    unsigned nlattices;
+    unsigned branching;
+    unsigned depth;
+    double wer;
+    unsigned tolerance;
+    unsigned seed;
+};
+
+struct vocabulary {
+    struct dictword **words;
+    double *cdf;
+    unsigned size;
+};
+
+
+static double uniform(void)
+{
+    return (rand() + 0.5) / ((double)RAND_MAX + 1);
+}
+
+static void vocabulary_init(struct vocabulary *voc, struct dict *dict,
+        unsigned size, double zipf)
+{
+    voc->size = size;
+    voc->words = xmalloc(size * sizeof *voc->words);
+    voc->cdf = xmalloc(size * sizeof *voc->cdf);
+
+    double sum = 0;
+    for (unsigned i = 0; i < size; i++) {
+        char str[16];
+        snprintf(str, sizeof str, "w%u", i);
+        voc->words[i] = dict_lookup_or_add(dict, str);
+        voc->cdf[i] = sum += pow(i + 1, -zipf);
+    }
+    for (unsigned i = 0; i < size; i++) voc->cdf[i] /= sum;
+}
+
+static void vocabulary_destroy(struct vocabulary *voc)
+{
+    free(voc->words);
+    free(voc->cdf);
+}
+
+static struct dictword *random_word(const struct vocabulary *voc)
+{
+    double u = uniform();
+    unsigned lo = 0, hi = voc->size - 1;
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        if (voc->cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+    }
+    return voc->words[lo];
+}
+
+
+static struct swlist *make_swlist(const struct options *opt,
+        const struct vocabulary *voc, struct swnode ***nodes)
+{
+    struct swlist *wl = swlist_create();
+    *nodes = xmalloc(opt->nwords * sizeof **nodes);
+    for (unsigned i = 0; i < opt->nwords; i++) {
+        unsigned cuestart = i / CUEWORDS * CUEWORDS * WORDTIME;
+        swlist_append(wl, random_word(voc),
+                cuestart, cuestart + CUEWORDS * WORDTIME);
+        (*nodes)[i] = wl->last;
+    }
+    swlist_index(wl);
+    return wl;
+}
+
+// lattice for the subtitle words from position `first`
+static struct lattice *make_lattice(const struct options *opt,
+        const struct vocabulary *voc, struct swnode **swnodes, unsigned first)
+{
+    unsigned depth = MIN(opt->depth, opt->nwords - first);
+    unsigned b = opt->branching;
+
+    struct lattice *lat = xmalloc(sizeof *lat);
+    *lat = (struct lattice) {
+        .nodes = xmalloc(depth * b * sizeof *lat->nodes),
+        .nnodes = depth * b,
+        .links = xmalloc((depth - 1) * b * b * sizeof *lat->links),
+    };
+
+    for (unsigned col = 0; col < depth; col++) {
+        timestamp_t time = (first + col) * WORDTIME + rand() % WORDTIME;
+        unsigned correct = rand() % b;
+
+        for (unsigned k = 0; k < b; k++) {
+            struct latnode *node = &lat->nodes[col * b + k];
+            *node = (struct latnode) {
+                .word = k == correct && uniform() >= opt->wer ?
+                        swnodes[first + col]->word : random_word(voc),
+                .time = time,
+                .exits = lat->nlinks,
+                .nexits = col + 1 < depth ? b : 0,
+                .nentries = col > 0 ? b : 0
+            };
+            for (unsigned j = 0; j < node->nexits; j++)
+                lat->links[lat->nlinks++] = (struct latlink) {
+                    .to = (col + 1) * b + j
+                };
+        }
+    }
+    return lat;
+}
+
+static void delete_lattice(struct lattice *lat)
+{
+    free(lat->nodes);
+    free(lat->links);
+    free(lat);
+}
+
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n words] [-v vocabulary] [-z zipf] "
+            "[-l lattices] [-b branching] [-d depth] [-e wer] "
+            "[-t tolerance_ms] [-r seed]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    struct options opt = {
+        .nwords = 5000, .vocabsize = 2000, .zipf = 1.0,
+        .nlattices = 100, .branching = 4, .depth = 20, .wer = 0.3,
+        .tolerance = 0, .seed = 1
+    };
+
+    int c;
+    while ((c = getopt(argc, argv, "n:v:z:l:b:d:e:t:r:")) != -1) {
+        switch (c) {
+        case 'n': opt.nwords = atoi(optarg); break;
+        case 'v': opt.vocabsize = atoi(optarg); break;
+        case 'z': opt.zipf = atof(optarg); break;
+        case 'l': opt.nlattices = atoi(optarg); break;
+        case 'b': opt.branching = atoi(optarg); break;
+        case 'd': opt.depth = atoi(optarg); break;
+        case 'e': opt.wer = atof(optarg); break;
+        case 't': opt.tolerance = atoi(optarg); break;
+        case 'r': opt.seed = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (opt.nwords < 2 || opt.vocabsize < 1 || opt.branching < 1 ||
+            opt.depth < 2)
+        usage(argv[0]);
+
+    srand(opt.seed);
+    struct dict *dict = dict_create();
+    struct vocabulary voc;
+    vocabulary_init(&voc, dict, opt.vocabsize, opt.zipf);
+
+    struct swnode **swnodes;
+    struct swlist *wl = make_swlist(&opt, &voc, &swnodes);
+    struct alignment *al = alignment_create(wl, opt.tolerance);
+
+    // lattices follow each other through the subtitles
+    double ns = 0;
+    unsigned step = MAX(1, (opt.nwords - 1) / opt.nlattices);
+    for (unsigned i = 0; i < opt.nlattices; i++) {
+        struct lattice *lat = make_lattice(&opt, &voc, swnodes,
+                MIN(i * step, opt.nwords - 2));
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        alignment_add_lattice(al, lat);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ns += (end.tv_sec - start.tv_sec) * 1e9 +
+                (end.tv_nsec - start.tv_nsec);
+
+        delete_lattice(lat);
+    }
+
+    printf("%u words, vocabulary %u (zipf %.2f), %u lattices "
+            "(branching %u, depth %u, wer %.2f), tolerance %u ms\n",
+            opt.nwords, opt.vocabsize, opt.zipf, opt.nlattices,
+            opt.branching, opt.depth, opt.wer, opt.tolerance);
+    alignment_print_stats(al, stdout);
+    const struct alignment_stats *st = alignment_get_stats(al);
+    printf("  %.3f s, %.1f us per lattice, %.1f ns per lattice node\n",
+            ns / 1e9, opt.nlattices ? ns / 1e3 / opt.nlattices : 0.0,
+            st->latnodes ? ns / st->latnodes : 0.0);
+
+    alignment_delete(al);
+    free(swnodes);
+    swlist_delete(wl);
+    vocabulary_destroy(&voc);
+    dict_delete(dict);
+    return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * Contention benchmark of the ordered queue.
+ *
+ * Build from the repository root:
+ *   cc -std=gnu11 -O2 -pthread -Isrc -o aqueuebench bench/aqueuebench.c \
+ *       src/aqueue.c src/common.c
+ *
+ * Link src/aqueue_lockfree.c instead of src/aqueue.c for the lock-free
+ * queue.
+ *
+ * `-p` producer threads push `-n` items through a queue of length `-l` to
+ * `-c` consumer threads. Producer k pushes the positions k, k + p, ... in
+ * order, as the voice recognition threads push their lattices. Every
+ * position must be popped exactly once.
+ */
+#include "common.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "aqueue.h"
+
+struct bench {
+    struct aqueue *q;
+    unsigned nitems;
+    unsigned nproducers;
+    atomic_uchar *popped;   // times each position was popped
+    atomic_uint outoforder; // pops of a position below the consumer's last
+};
+
+struct worker {
+    pthread_t thread;
+    struct bench *b;
+    unsigned index;
+};
+
+
+static void *producer(void *ptr)
+{
+    struct worker *w = ptr;
+    struct bench *b = w->b;
+    for (unsigned pos = w->index; pos < b->nitems; pos += b->nproducers)
+        if (!aqueue_push(b->q, (void*)(uintptr_t)(pos + 1), pos))
+            break;
+    return NULL;
+}
+
+static void *consumer(void *ptr)
+{
+    struct worker *w = ptr;
+    struct bench *b = w->b;
+    unsigned pos, last = 0;
+    bool first = true;
+    void *item;
+    while ((item = aqueue_pop(b->q, &pos))) {
+        CHECK((uintptr_t)item == pos + 1 && pos < b->nitems);
+        atomic_fetch_add(&b->popped[pos], 1);
+        if (!first && pos <= last) atomic_fetch_add(&b->outoforder, 1);
+        last = pos;
+        first = false;
+    }
+    return NULL;
+}
+
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-p producers] [-c consumers] [-n items] "
+            "[-l length]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned nproducers = 1, nconsumers = 8, nitems = 200000, length = 8;
+
+    int c;
+    while ((c = getopt(argc, argv, "p:c:n:l:")) != -1) {
+        switch (c) {
+        case 'p': nproducers = atoi(optarg); break;
+        case 'c': nconsumers = atoi(optarg); break;
+        case 'n': nitems = atoi(optarg); break;
+        case 'l': length = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (nproducers < 1 || nconsumers < 1 || length < 1)
+        usage(argv[0]);
+
+    struct bench b = {
+        .q = aqueue_create(length),
+        .nitems = nitems,
+        .nproducers = nproducers,
+        .popped = xmalloc(nitems * sizeof *b.popped),
+    };
+    for (unsigned i = 0; i < nitems; i++) atomic_init(&b.popped[i], 0);
+    atomic_init(&b.outoforder, 0);
+
+    struct worker *producers = xmalloc(nproducers * sizeof *producers);
+    struct worker *consumers = xmalloc(nconsumers * sizeof *consumers);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (unsigned i = 0; i < nconsumers; i++) {
+        consumers[i] = (struct worker){ .b = &b, .index = i };
+        CHECK(!pthread_create(&consumers[i].thread, NULL,
+                consumer, &consumers[i]));
+    }
+    for (unsigned i = 0; i < nproducers; i++) {
+        producers[i] = (struct worker){ .b = &b, .index = i };
+        CHECK(!pthread_create(&producers[i].thread, NULL,
+                producer, &producers[i]));
+    }
+
+    for (unsigned i = 0; i < nproducers; i++)
+        CHECK(!pthread_join(producers[i].thread, NULL));
+
+    // wait until all items are popped, closing discards remaining ones
+    for (unsigned i = 0; i < nitems; i++)
+        while (!atomic_load(&b.popped[i])) sched_yield();
+    aqueue_close(b.q);
+
+    for (unsigned i = 0; i < nconsumers; i++)
+        CHECK(!pthread_join(consumers[i].thread, NULL));
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ns = (end.tv_sec - start.tv_sec) * 1e9 +
+            (end.tv_nsec - start.tv_nsec);
+
+    unsigned wrong = 0;
+    for (unsigned i = 0; i < nitems; i++)
+        if (atomic_load(&b.popped[i]) != 1) wrong++;
+
+    printf("%u producers, %u consumers, %u items, length %u\n",
+            nproducers, nconsumers, nitems, length);
+    printf("  %.3f s, %.1f ns per item\n", ns / 1e9,
+            nitems ? ns / nitems : 0.0);
+    if (wrong || atomic_load(&b.outoforder))
+        printf("  ERROR: %u positions not popped once, %u out of order\n",
+                wrong, atomic_load(&b.outoforder));
+
+    aqueue_delete(b.q, NULL);
+    free(b.popped);
+    free(producers);
+    free(consumers);
+    return wrong || atomic_load(&b.outoforder) ? 1 : 0;
+}
@@ -0,0 +1,299 @@
+/*
+ * Lookup benchmark of the MAKE_HASHTABLE table against the linear probing
+ * table it replaced, which is copied below.
+ *
+ * Build from the repository root:
+ *   cc -std=gnu11 -O2 -Isrc -o hashbench bench/hashbench.c \
+ *       src/hashtable.c src/common.c
+ *
+ * The keys are `-n` random words of 2 to 12 letters, or the words of the
+ * dictionary file `-f` (first column). They are inserted into both tables
+ * with the string hash of dict.c, then `-l` lookups are timed, of which a
+ * fraction `-m` are for words that are not in the table. Hash values are
+ * computed before timing. Both tables must find the same words.
+ */
+#include "common.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "hashtable.h"
+
+struct item {
+    hashval_t hashval;
+    char string[];
+};
+
+struct key {
+    const char *string;
+    hashval_t hashval;
+    bool miss;          // string is allocated for the key
+};
+
+
+static hashval_t hashfunc(const char *str)
+{
+    hashval_t hash = 5381;
+    while (*str) hash = hash * 33 + *str++;
+    return hash;
+}
+
+static inline bool matchitem(const struct item *item, const char *key)
+{
+    return strcmp(key, item->string) == 0;
+}
+
+MAKE_HASHTABLE(itemtable, struct item, char, matchitem)
+
+static struct item *createitem(const char *key, void *userptr)
+{
+    (void)userptr;
+    size_t len = strlen(key);
+    struct item *item = xmalloc(sizeof *item + len + 1);
+    item->hashval = hashfunc(key);
+    memcpy(item->string, key, len + 1);
+    return item;
+}
+
+static void free_item(void *item, void *userptr)
+{
+    (void)userptr;
+    free(item);
+}
+
+
+/*
+ * The previous table: open addressing with linear probing over item
+ * pointers, resized to four times the size at load 1/2. The hash value is
+ * stored in the items.
+ */
+struct oldtable {
+    void **table;
+    size_t tablesize;
+    size_t count;
+};
+
+static void oldtable_resize(struct oldtable *ht, size_t newsize)
+{
+    void **newtable = xmalloc(newsize * sizeof *newtable);
+    for (size_t i = 0; i < newsize; i++)
+        newtable[i] = NULL;
+
+    for (size_t i = 0; i < ht->tablesize; i++) {
+        if (!ht->table[i]) continue;
+        hashval_t h = ((struct item*)ht->table[i])->hashval;
+
+        size_t j = h & (newsize - 1);
+        while (newtable[j])
+            j = (j + 1) & (newsize - 1);
+
+        newtable[j] = ht->table[i];
+    }
+
+    free(ht->table);
+    ht->table = newtable;
+    ht->tablesize = newsize;
+}
+
+static bool oldmatch(const void *item, const void *key)
+{
+    return matchitem(item, key);
+}
+
+// the match function is called through a pointer, as in the old table
+static void **oldtable_lookup_ptr(const struct oldtable *ht,
+        hashval_t hashval, bool (*match)(const void *item, const void *key),
+        const void *key)
+{
+    size_t i = hashval & (ht->tablesize - 1);
+    while (ht->table[i]) {
+        if (match(ht->table[i], key)) break;
+        i = (i + 1) & (ht->tablesize - 1);
+    }
+    return &ht->table[i];
+}
+
+static struct item *oldtable_lookup_or_add(struct oldtable *ht,
+        hashval_t hashval, const char *key)
+{
+    void **slot = oldtable_lookup_ptr(ht, hashval, oldmatch, key);
+    if (!*slot) {
+        *slot = createitem(key, NULL);
+        if (++ht->count > ht->tablesize / 2)
+            oldtable_resize(ht, ht->tablesize * 4);
+    }
+    return *slot;
+}
+
+
+static double uniform(void)
+{
+    return (rand() + 0.5) / ((double)RAND_MAX + 1);
+}
+
+static double ns_since(const struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 +
+            (end.tv_nsec - start->tv_nsec);
+}
+
+static char *random_word(void)
+{
+    unsigned len = 2 + rand() % 11;
+    char *str = xmalloc(len + 1);
+    for (unsigned i = 0; i < len; i++)
+        str[i] = 'a' + rand() % 26;
+    str[len] = '\0';
+    return str;
+}
+
+// first column of each line, NULL on error
+static char **read_words(const char *filename, unsigned *nwords)
+{
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        error("Could not open '%s': %s", filename, strerror(errno));
+        return NULL;
+    }
+
+    char **words = NULL;
+    size_t alloc = 0;
+    unsigned n = 0;
+    char *line = NULL;
+    size_t linealloc = 0;
+    while (getline(&line, &linealloc, file) >= 0) {
+        size_t len = strcspn(line, " \t\r\n");
+        if (len == 0) continue;
+        if (n == alloc)
+            words = grow_array(words, sizeof *words, &alloc, n + 1);
+        words[n] = xmalloc(len + 1);
+        memcpy(words[n], line, len);
+        words[n++][len] = '\0';
+    }
+    free(line);
+    fclose(file);
+
+    *nwords = n;
+    return words;
+}
+
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n words | -f dictionary] [-l lookups] "
+            "[-m miss_ratio] [-r seed]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned nwords = 130000, nlookups = 4000000, seed = 1;
+    double missratio = 0.5;
+    const char *filename = NULL;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:f:l:m:r:")) != -1) {
+        switch (c) {
+        case 'n': nwords = atoi(optarg); break;
+        case 'f': filename = optarg; break;
+        case 'l': nlookups = atoi(optarg); break;
+        case 'm': missratio = atof(optarg); break;
+        case 'r': seed = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (missratio < 0 || missratio > 1)
+        usage(argv[0]);
+
+    srand(seed);
+    char **words;
+    if (filename) {
+        if (!(words = read_words(filename, &nwords)))
+            return EXIT_FAILURE;
+    } else {
+        words = xmalloc(nwords * sizeof *words);
+        for (unsigned i = 0; i < nwords; i++) words[i] = random_word();
+    }
+    if (nwords == 0) usage(argv[0]);
+
+    // misses are words with a prefix that the table words do not have
+    struct key *keys = xmalloc(nlookups * sizeof *keys);
+    for (unsigned i = 0; i < nlookups; i++) {
+        const char *str = words[rand() % nwords];
+        bool miss = uniform() < missratio;
+        if (miss) {
+            char *buf = xmalloc(strlen(str) + 2);
+            buf[0] = '#';
+            strcpy(buf + 1, str);
+            str = buf;
+        }
+        keys[i] = (struct key){ str, hashfunc(str), miss };
+    }
+
+    struct timespec start;
+    struct oldtable old = {0};
+    oldtable_resize(&old, 256);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned i = 0; i < nwords; i++)
+        oldtable_lookup_or_add(&old, hashfunc(words[i]), words[i]);
+    double old_insert = ns_since(&start);
+
+    struct itemtable *new = itemtable_create();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned i = 0; i < nwords; i++)
+        itemtable_lookup_or_add(new, hashfunc(words[i]), words[i],
+                createitem, NULL);
+    double new_insert = ns_since(&start);
+
+    unsigned old_found = 0, new_found = 0, differ = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned i = 0; i < nlookups; i++)
+        old_found += *oldtable_lookup_ptr(&old, keys[i].hashval, oldmatch,
+                keys[i].string) != NULL;
+    double old_lookup = ns_since(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned i = 0; i < nlookups; i++)
+        new_found += itemtable_lookup(new, keys[i].hashval,
+                keys[i].string) != NULL;
+    double new_lookup = ns_since(&start);
+
+    for (unsigned i = 0; i < nlookups; i++) {
+        struct item *a = *oldtable_lookup_ptr(&old, keys[i].hashval,
+                oldmatch, keys[i].string);
+        struct item *b = itemtable_lookup(new, keys[i].hashval,
+                keys[i].string);
+        if (!a != !b || (a && strcmp(a->string, b->string)))
+            differ++;
+    }
+
+    printf("%u words (%zu distinct), %u lookups, miss ratio %.2f\n",
+            nwords, itemtable_count(new), nlookups, missratio);
+    printf("  old: insert %.1f ns per word, lookup %.1f ns, %u found\n",
+            old_insert / nwords, nlookups ? old_lookup / nlookups : 0.0,
+            old_found);
+    printf("  new: insert %.1f ns per word, lookup %.1f ns, %u found\n",
+            new_insert / nwords, nlookups ? new_lookup / nlookups : 0.0,
+            new_found);
+    struct hashtable_stats stats;
+    itemtable_get_stats(new, &stats);
+    hashtable_print_stats(&stats, "  new table", stdout);
+    bool failed = differ || old.count != itemtable_count(new);
+    if (failed)
+        printf("  ERROR: %u lookups differ, %zu old items\n", differ,
+                old.count);
+
+    for (size_t i = 0; i < old.tablesize; i++) free(old.table[i]);
+    free(old.table);
+    itemtable_foreach(new, free_item, NULL, NULL);
+    itemtable_delete(new);
+    for (unsigned i = 0; i < nlookups; i++)
+        if (keys[i].miss) free((char*)keys[i].string);
+    for (unsigned i = 0; i < nwords; i++) free(words[i]);
+    free(words);
+    free(keys);
+    return failed ? 1 : 0;
+}
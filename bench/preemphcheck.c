@@ -0,0 +1,129 @@
+/*
+ * Checks the pre-emphasis energy kernels of audio.c against each other and
+ * against a double precision reference, and times them.
+ *
+ * Build from the repository root:
+ *   cc -std=gnu11 -O2 -Isrc -o preemphcheck bench/preemphcheck.c \
+ *       src/common.c -lm
+ *
+ * audio.c is included, the kernels are static. Exits with status 1 if a
+ * kernel differs from the reference by more than the float rounding error.
+ */
+#include "../src/audio.c"
+
+#include <math.h>
+#include <time.h>
+
+#define NBLOCKS 20000
+#define BLOCKLEN 800
+#define MAXLEN 1000
+
+struct kernel {
+    const char *name;
+    sum_squares_func *func;
+};
+
+
+static double reference(size_t length, const int16_t *samples,
+        int16_t prev_sample)
+{
+    double sum = 0;
+    int prev = prev_sample;
+    for (size_t i = 0; i < length; i++) {
+        double diff = samples[i] - prev;
+        sum += diff * diff;
+        prev = samples[i];
+    }
+    return sum;
+}
+
+// noise of random amplitude, sometimes full scale to test for overflows
+static void random_samples(int16_t *samples, size_t length)
+{
+    int amplitude = rand() % 8 == 0 ? 32768 : 1 << rand() % 16;
+    for (size_t i = 0; i < length; i++) {
+        long v = (long)rand() % (2 * amplitude) - amplitude;
+        if (rand() % 16 == 0) v = rand() % 2 ? INT16_MIN : INT16_MAX;
+        samples[i] = MAX(MIN(v, INT16_MAX), INT16_MIN);
+    }
+}
+
+static unsigned check(const struct kernel *k)
+{
+    unsigned failures = 0;
+
+    for (unsigned n = 0; n < NBLOCKS; n++) {
+        // every length up to MAXLEN, then random ones; buf[0] is the
+        // previous sample, the exact size lets sanitizers find overreads
+        size_t length = n < MAXLEN ? n : (size_t)rand() % (MAXLEN + 1);
+        int16_t *buf = xmalloc((length + 1) * sizeof *buf);
+        int16_t *samples = buf + 1;
+        random_samples(buf, length + 1);
+
+        double want = reference(length, samples, buf[0]);
+        float got = k->func(length, samples, buf[0]);
+
+        // float sums of up to MAXLEN terms below 2^32 each
+        if (fabs(got - want) > 1e-5 * want + 1e-3) {
+            if (failures++ < 10)
+                fprintf(stderr, "%s: length %zu: %.1f instead of %.1f\n",
+                        k->name, length, got, want);
+        }
+        free(buf);
+    }
+    return failures;
+}
+
+static double time_kernel(const struct kernel *k, const int16_t *samples,
+        size_t nsamples)
+{
+    struct timespec start, end;
+    volatile float sink = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int rep = 0; rep < 10; rep++)
+        for (size_t i = 0; i + BLOCKLEN <= nsamples; i += BLOCKLEN)
+            sink += k->func(BLOCKLEN, samples + i, i ? samples[i - 1] : 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    (void)sink;
+    double ns = (end.tv_sec - start.tv_sec) * 1e9 +
+            (end.tv_nsec - start.tv_nsec);
+    return ns / (10.0 * (nsamples / BLOCKLEN));
+}
+
+int main(void)
+{
+    struct kernel kernels[3] = {
+        { "scalar", sum_squares_preemph_scalar },
+    };
+    unsigned nkernels = 1;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        kernels[nkernels++] = (struct kernel){
+                "sse2", sum_squares_preemph_sse2 };
+    if (__builtin_cpu_supports("avx2"))
+        kernels[nkernels++] = (struct kernel){
+                "avx2", sum_squares_preemph_avx2 };
+#endif
+
+    size_t nsamples = 60 * 16000;
+    int16_t *samples = xmalloc(nsamples * sizeof *samples);
+
+    unsigned failures = 0;
+    for (unsigned i = 0; i < nkernels; i++) {
+        srand(1);
+        unsigned f = check(&kernels[i]);
+        failures += f;
+
+        srand(2);
+        random_samples(samples, nsamples);
+        printf("%-6s %s, %.1f ns per block of %u samples\n", kernels[i].name,
+                f ? "FAILED" : "ok", time_kernel(&kernels[i], samples,
+                        nsamples), BLOCKLEN);
+    }
+    if (select_sum_squares_preemph() != kernels[nkernels - 1].func)
+        printf("note: audio.c selects a different kernel\n");
+
+    free(samples);
+    return failures ? 1 : 0;
+}
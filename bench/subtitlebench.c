@@ -0,0 +1,299 @@
+/*
+ * Throughput benchmark of the subtitle reader: line reading, encoding
+ * detection, tokenizer and dictionary lookups.
+ *
+ * Build from the repository root:
+ *   cc -std=gnu11 -O2 -Isrc -o subtitlebench bench/subtitlebench.c \
+ *       src/subtitle.c src/subwords.c src/dict.c src/srcdict.c \
+ *       src/hashtable.c src/alloc.c src/text.c src/common.c
+ *
+ * Reads the SRT file `-s` with the dictionary `-d`, or generates both in a
+ * temporary directory: `-n` cues of one or two lines with 3 to 6 words,
+ * drawn from a vocabulary of `-v` words with Zipf exponent 1. A tenth of
+ * the words have accented or Cyrillic letters, a twentieth are not in the
+ * dictionary. Lines contain punctuation, html tags, bracketed text, speaker
+ * names and hyphenated words. The file is read `-r` times, the fastest
+ * run is reported.
+ */
+#include "common.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dict.h"
+#include "srcdict.h"
+#include "subtitle.h"
+#include "subwords.h"
+
+struct vocabulary {
+    char **words;
+    double *cdf;
+    unsigned size;
+};
+
+
+static double uniform(void)
+{
+    return (rand() + 0.5) / ((double)RAND_MAX + 1);
+}
+
+// letters of generated words, some of them two bytes in UTF-8
+static const char *const letters[] = {
+    "a", "b", "c", "d", "e", "f", "g", "h", "i", "k", "l", "m", "n", "o",
+    "p", "r", "s", "t", "u", "w", "é", "ü", "ñ", "д", "ж", "я"
+};
+#define NASCII 20
+
+static char *random_word(void)
+{
+    bool ascii = rand() % 10 != 0;
+    unsigned nletters = ascii ? NASCII : sizeof letters / sizeof *letters;
+    unsigned len = 2 + rand() % 9;
+
+    char buf[64] = "";
+    for (unsigned i = 0; i < len; i++)
+        strcat(buf, letters[rand() % nletters]);
+    if (!ascii) strcat(buf, letters[NASCII + rand() % 6]);
+
+    char *str = xmalloc(strlen(buf) + 1);
+    strcpy(str, buf);
+    return str;
+}
+
+static void vocabulary_init(struct vocabulary *voc, unsigned size)
+{
+    voc->size = size;
+    voc->words = xmalloc(size * sizeof *voc->words);
+    voc->cdf = xmalloc(size * sizeof *voc->cdf);
+
+    double sum = 0;
+    for (unsigned i = 0; i < size; i++) {
+        voc->words[i] = random_word();
+        voc->cdf[i] = sum += 1.0 / (i + 1);
+    }
+    for (unsigned i = 0; i < size; i++) voc->cdf[i] /= sum;
+}
+
+static void vocabulary_destroy(struct vocabulary *voc)
+{
+    for (unsigned i = 0; i < voc->size; i++) free(voc->words[i]);
+    free(voc->words);
+    free(voc->cdf);
+}
+
+static const char *random_vocword(const struct vocabulary *voc)
+{
+    double u = uniform();
+    unsigned lo = 0, hi = voc->size - 1;
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        if (voc->cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+    }
+    return voc->words[lo];
+}
+
+
+static bool write_dictionary(const char *filename,
+        const struct vocabulary *voc)
+{
+    FILE *file = fopen(filename, "w");
+    if (!file) {
+        error("Could not write to '%s': %s", filename, strerror(errno));
+        return false;
+    }
+    for (unsigned i = 0; i < voc->size; i++) {
+        if (i % 20 == 19) continue; // unknown word
+        fprintf(file, "%s\tAH B%u\n", voc->words[i], i % 7);
+        if (i % 5 == 0)
+            fprintf(file, "%s(2)\tAA B%u\n", voc->words[i], i % 7);
+    }
+    bool err = fclose(file) != 0;
+    if (err) error("Error while writing to '%s'", filename);
+    return !err;
+}
+
+// first letter upper case if it is ASCII
+static void write_word(FILE *file, const char *word, bool capital)
+{
+    if (capital && word[0] >= 'a' && word[0] <= 'z') {
+        fputc(word[0] - 'a' + 'A', file);
+        word++;
+    }
+    fputs(word, file);
+}
+
+static void write_line(FILE *file, const struct vocabulary *voc)
+{
+    static const char *const punct[] = { "", "", "", ",", ".", "?", "!" };
+    unsigned r = rand() % 100;
+    if (r < 3) fputs("JOHN: ", file);
+    else if (r < 8) fputs("- ", file);
+
+    bool italic = rand() % 20 == 0;
+    if (italic) fputs("<i>", file);
+
+    unsigned nwords = 3 + rand() % 4;
+    for (unsigned i = 0; i < nwords; i++) {
+        if (i > 0) fputc(' ', file);
+        if (rand() % 40 == 0) fputs("[MUSIC] ", file);
+        write_word(file, random_vocword(voc), i == 0);
+        if (rand() % 30 == 0) {
+            fputc('-', file);
+            write_word(file, random_vocword(voc), false);
+        }
+        fputs(punct[rand() % 7], file);
+    }
+
+    if (italic) fputs("</i>", file);
+    fputc('\n', file);
+}
+
+static bool write_subtitles(const char *filename, unsigned ncues,
+        const struct vocabulary *voc)
+{
+    FILE *file = fopen(filename, "w");
+    if (!file) {
+        error("Could not write to '%s': %s", filename, strerror(errno));
+        return false;
+    }
+
+    unsigned time = 0;
+    for (unsigned i = 0; i < ncues; i++) {
+        unsigned start = time, end = time + 1500 + rand() % 2000;
+        time = end + rand() % 1000;
+        fprintf(file, "%u\n%02u:%02u:%02u,%03u --> %02u:%02u:%02u,%03u\n",
+                i + 1, start / 3600000, start / 60000 % 60,
+                start / 1000 % 60, start % 1000, end / 3600000,
+                end / 60000 % 60, end / 1000 % 60, end % 1000);
+        write_line(file, voc);
+        if (rand() % 2) write_line(file, voc);
+        fputc('\n', file);
+    }
+
+    bool err = fclose(file) != 0;
+    if (err) error("Error while writing to '%s'", filename);
+    return !err;
+}
+
+// removes the generated files, including the dictionary index
+static void remove_dir(const char *dirname)
+{
+    DIR *dir = opendir(dirname);
+    if (!dir) return;
+    for (struct dirent *ent; (ent = readdir(dir));) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+        char path[4096];
+        snprintf(path, sizeof path, "%s/%s", dirname, ent->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+    rmdir(dirname);
+}
+
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s subtitles -d dictionary | -n cues "
+            "-v vocabulary] [-r runs] [-e seed]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    const char *subfilename = NULL, *dicfilename = NULL;
+    unsigned ncues = 400000, vocabsize = 20000, nruns = 3, seed = 1;
+
+    int c;
+    while ((c = getopt(argc, argv, "s:d:n:v:r:e:")) != -1) {
+        switch (c) {
+        case 's': subfilename = optarg; break;
+        case 'd': dicfilename = optarg; break;
+        case 'n': ncues = atoi(optarg); break;
+        case 'v': vocabsize = atoi(optarg); break;
+        case 'r': nruns = atoi(optarg); break;
+        case 'e': seed = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (!subfilename != !dicfilename || vocabsize < 1 || nruns < 1)
+        usage(argv[0]);
+
+    char dirname[] = "/tmp/subtitlebenchXXXXXX";
+    char subpath[64], dicpath[64];
+    bool generated = !subfilename;
+    if (generated) {
+        if (!mkdtemp(dirname)) {
+            error("Could not create directory: %s", strerror(errno));
+            return EXIT_FAILURE;
+        }
+        snprintf(subpath, sizeof subpath, "%s/corpus.srt", dirname);
+        snprintf(dicpath, sizeof dicpath, "%s/corpus.dic", dirname);
+        subfilename = subpath;
+        dicfilename = dicpath;
+
+        srand(seed);
+        struct vocabulary voc;
+        vocabulary_init(&voc, vocabsize);
+        bool written = write_dictionary(dicfilename, &voc) &&
+                write_subtitles(subfilename, ncues, &voc);
+        vocabulary_destroy(&voc);
+        if (!written) {
+            remove_dir(dirname);
+            return EXIT_FAILURE;
+        }
+    }
+
+    int status = EXIT_FAILURE;
+    struct stat st;
+    struct srcdict *srcdict = srcdict_open(dicfilename);
+    if (!srcdict) goto end;
+    if (stat(subfilename, &st) < 0) {
+        error("Could not stat '%s': %s", subfilename, strerror(errno));
+        goto end;
+    }
+
+    double best = INFINITY;
+    unsigned nwords = 0, nunknown = 0, nvocab = 0;
+    for (unsigned run = 0; run < nruns; run++) {
+        struct dict *dict = dict_create();
+        struct swlist *wl = swlist_create();
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bool success = subtitle_readwords(subfilename, wl, dict, srcdict);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        best = MIN(best, (end.tv_sec - start.tv_sec) * 1e9 +
+                (end.tv_nsec - start.tv_nsec));
+
+        nwords = wl->length;
+        nunknown = 0;
+        FOREACH(struct swnode, node, wl->first, seq_next)
+            if (!node->word) nunknown++;
+        nvocab = 0;
+        FOREACH(struct swnode, node, wl->first, seq_next)
+            if (node->word && node->word->occurs[0].swnode == node)
+                nvocab++;
+
+        swlist_delete(wl);
+        dict_delete(dict);
+        if (!success) goto end;
+    }
+
+    printf("%s: %.1f MB, %u words (%u unknown, %u distinct), %u runs\n",
+            generated ? "generated corpus" : subfilename, st.st_size / 1e6,
+            nwords, nunknown, nvocab, nruns);
+    printf("  best %.3f s, %.1f MB/s, %.1f ns per word\n", best / 1e9,
+            st.st_size / 1e6 / (best / 1e9), nwords ? best / nwords : 0.0);
+    status = EXIT_SUCCESS;
+end:
+    if (srcdict) srcdict_close(srcdict);
+    if (generated) remove_dir(dirname);
+    return status;
+}
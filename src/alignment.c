@@ -1,66 +1,95 @@
 #include "alignment.h"
 
+#include <limits.h>
+
 #include "alloc.h"
 #include "subwords.h"
 #include "lattice.h"
 #include "dict.h"
 
-static unsigned cc[10] = {0};
+/*
+ * Trees and pathes are persistent and shared, but not reference counted.
+ * Nodes created for a lattice are allocated in arenas of the lattice.
+ * After the lattice, the ones reachable from the pathes at its end are
+ * moved to the arenas of older nodes and the arenas of the lattice are
+ * freed at once. Nodes only refer to older ones, so older nodes are not
+ * touched, they are collected by copying when their arenas have grown
+ * to twice the size after the last full collection.
+ */
+
+#define ARENA_CHUNKLEN 4096
+#define MOVED UINT_MAX  // generation of moved nodes, which link to the copy
+
+struct alpathnode {
+    unsigned generation;     // lattice it was created for, pred is copy
+                             // if MOVED
+    timestamp_t time;
+    struct swnode *swnode;
+    struct alpathnode *pred; // null for beginning of path
+};
+
+struct alnode {
+    bool ispath;
+    unsigned generation;     // as for path nodes, left is copy if MOVED
+    unsigned minscore, maxscore; // same for path nodes
+
+    union {
+        struct {
+            struct alnode *left, *right;
+        };
+        struct {
+            struct alpathnode *tail; // null for empty path
+        };
+    };
+};
 
-static inline struct alnode *ref(struct alnode *node)
-{
-    node->refcount++;
-    return node;
-}
+struct alignment {
+    fixed_allocator_t *nodes;       // tree nodes of current lattice
+    fixed_allocator_t *paths;       // path elements of current lattice
+    fixed_allocator_t *oldnodes;    // of earlier lattices
+    fixed_allocator_t *oldpaths;
+    size_t noldnodes, noldpaths;
+    size_t fullcollect;             // old nodes for next full collection
+    unsigned generation;            // current lattice
+
+    struct alnode *pathes;
+    struct alnode empty;
+    unsigned width;
+    timestamp_t tolerance;
+
+    struct alnode **nodepathes; // pathes of each lattice node
+    size_t maxnodes;
 
-static void delete(struct alnode *node, struct alignment *al);
+    struct alignment_stats stats;
+};
 
-static inline void unref(struct alnode *node, struct alignment *al)
+
+static inline struct alnode *alloc_node(struct alignment *al)
 {
-    if (--node->refcount == 0)
-        delete(node, al);
+    struct alignment_stats *st = &al->stats;
+    st->nodes_allocated++;
+    st->nodes_live++;
+    st->nodes_peak = MAX(st->nodes_peak, st->nodes_live);
+    return fixed_alloc(al->nodes);
 }
 
-static void delete(struct alnode *node, struct alignment *al)
+static inline struct alpathnode *alloc_pathnode(struct alignment *al)
 {
-    if (node->ispath) {
-        struct alpathnode *pn = node->tail;
-        while (pn && --pn->refcount == 0) {
-            struct alpathnode *pred = pn->pred;
-            pool_free(node, al->pnalloc);
-            pn = pred;
-        }
-    }
-    else {
-        unref(node->left, al);
-        unref(node->right, al);
-    }
-    pool_free(node, al->alloc);
+    struct alignment_stats *st = &al->stats;
+    st->pathnodes_allocated++;
+    st->pathnodes_live++;
+    st->pathnodes_peak = MAX(st->pathnodes_peak, st->pathnodes_live);
+    return fixed_alloc(al->paths);
 }
 
-/*
 static struct alnode *make_tree(struct alnode *left, struct alnode *right,
         struct alignment *al)
 {
-    struct alnode *node = pool_alloc(al->alloc);
+    struct alnode *node = alloc_node(al);
     *node = (struct alnode) {
+        .generation = al->generation,
         .minscore = left ? left->minscore : 0,
         .maxscore = right->maxscore,
-        .refcount = 1,
-        .left = ref(left),
-        .right = ref(right)
-    };
-    return node;
-}*/
-
-static struct alnode *make_tree_haverefs(struct alnode *left, struct alnode *right,
-        struct alignment *al)
-{
-    struct alnode *node = pool_alloc(al->alloc);
-    *node = (struct alnode) {
-        .minscore = left ? left->minscore : 0,
-        .maxscore = right->maxscore,
-        .refcount = 1,
         .left = left,
         .right = right
     };
@@ -72,20 +101,21 @@ static struct alnode *merge_path_complete(struct alnode *into,
         struct alnode *path, struct alignment *al)
 {
     assert(path->ispath && path->minscore > into->minscore);
+    al->stats.merges++;
 
     if (into->ispath) {
-        return ref(path);
+        return path;
     }
     else if (path->minscore >= into->maxscore) {
-        return ref(path);
+        return path;
     }
     else {
         struct alnode *left = merge_path_complete(into->left, path, al);
         struct alnode *right = path->minscore > into->right->minscore ?
                 merge_path_complete(into->right, path, al) :
-                ref(into->right);
+                into->right;
 
-        return make_tree_haverefs(left, right, al);
+        return make_tree(left, right, al);
     }
 }
 
@@ -95,18 +125,19 @@ static struct alnode *merge_pathes(struct alnode *into, unsigned width,
 {
     assert(into->ispath && path->ispath &&
             pos > 0 && pos < width && into->minscore < path->minscore);
+    al->stats.merges++;
 
     unsigned splitpos = width / 2;
 
     struct alnode *left = pos < splitpos ?
             merge_pathes(into, splitpos, path, pos, al) :
-            ref(into);
+            into;
 
     struct alnode *right = pos > splitpos ?
             merge_pathes(into, splitpos, path, pos - splitpos, al) :
-            ref(path);
+            path;
 
-    return make_tree_haverefs(left, right, al);
+    return make_tree(left, right, al);
 }
 
 static struct alnode *merge_path_partial(struct alnode *into, unsigned width,
@@ -115,6 +146,7 @@ static struct alnode *merge_path_partial(struct alnode *into, unsigned width,
     assert(path->ispath &&
             pos > 0 && pos < width &&
             path->minscore > into->minscore);
+    al->stats.merges++;
 
     if (into->ispath) {
         return merge_pathes(into, width, path, pos, al);
@@ -142,9 +174,9 @@ static struct alnode *merge_path_partial(struct alnode *into, unsigned width,
         }
 
         if (left || right) {
-            return make_tree_haverefs(
-                    left ? left : ref(into->left),
-                    right ? right : ref(into->right), al);
+            return make_tree(
+                    left ? left : into->left,
+                    right ? right : into->right, al);
         } else {
             return NULL;
         }
@@ -157,9 +189,10 @@ static struct alnode *merge_tree(struct alnode *into,
         struct alnode *tree, struct alignment *al)
 {
     assert(tree->maxscore > into->minscore);
+    al->stats.merges++;
 
     if (tree->minscore >= into->maxscore) {
-        return ref(tree);
+        return tree;
     }
     else if (tree->ispath) {
         return merge_path_complete(into, tree, al);
@@ -168,7 +201,7 @@ static struct alnode *merge_tree(struct alnode *into,
         if (into->minscore > tree->minscore) {
             return merge_path_complete(tree, into, al);
         } else {
-            return ref(tree);
+            return tree;
         }
     }
     else {
@@ -189,9 +222,9 @@ static struct alnode *merge_tree(struct alnode *into,
         }
 
         if (left || right) {
-            return make_tree_haverefs(
-                    left ? left : ref(into->left),
-                    right ? right : ref(into->right), al);
+            return make_tree(
+                    left ? left : into->left,
+                    right ? right : into->right, al);
         } else {
             return NULL;
         }
@@ -213,39 +246,120 @@ static struct alnode *tree_lookup(
 }
 
 
-struct alignment *alignment_create(struct swlist *swl)
+/*
+ * Moves the path elements of the chain that are of generation `mingen`
+ * or later to `to`, up to the first one that stays or was moved already.
+ */
+static struct alpathnode *move_path(struct alpathnode *pn,
+        unsigned mingen, fixed_allocator_t *to, struct alignment *al)
+{
+    struct alpathnode *head, **link = &head;
+    while (pn && pn->generation >= mingen && pn->generation != MOVED) {
+        struct alpathnode *copy = fixed_alloc(to);
+        *copy = *pn;
+        pn->generation = MOVED;
+        pn->pred = copy;
+        al->noldpaths++;
+
+        *link = copy;
+        link = &copy->pred;
+        pn = copy->pred;
+    }
+    *link = pn && pn->generation == MOVED ? pn->pred : pn;
+    return head;
+}
+
+static struct alnode *move_tree(struct alnode *node, unsigned mingen,
+        fixed_allocator_t *nodesto, fixed_allocator_t *pathsto,
+        struct alignment *al)
+{
+    if (node == &al->empty || node->generation < mingen) return node;
+    if (node->generation == MOVED) return node->left;
+
+    struct alnode *copy = fixed_alloc(nodesto);
+    *copy = *node;
+    if (node->ispath) {
+        copy->tail = move_path(node->tail, mingen, pathsto, al);
+    } else {
+        copy->left = move_tree(node->left, mingen, nodesto, pathsto, al);
+        copy->right = move_tree(node->right, mingen, nodesto, pathsto, al);
+    }
+    node->generation = MOVED;
+    node->left = copy;
+    al->noldnodes++;
+    return copy;
+}
+
+// keeps the pathes at the end of the lattice, frees the rest of it
+static void collect(struct alignment *al)
+{
+    bool full = al->noldnodes + al->noldpaths >= al->fullcollect;
+    fixed_allocator_t *nodesto = al->oldnodes, *pathsto = al->oldpaths;
+    if (full) {
+        nodesto = fixed_allocator_create(
+                sizeof (struct alnode), ARENA_CHUNKLEN);
+        pathsto = fixed_allocator_create(
+                sizeof (struct alpathnode), ARENA_CHUNKLEN);
+        al->noldnodes = al->noldpaths = 0;
+    }
+
+    al->pathes = move_tree(al->pathes,
+            full ? 0 : al->generation, nodesto, pathsto, al);
+
+    fixed_allocator_clear(al->nodes);
+    fixed_allocator_clear(al->paths);
+    if (full) {
+        fixed_allocator_delete(al->oldnodes);
+        fixed_allocator_delete(al->oldpaths);
+        al->oldnodes = nodesto;
+        al->oldpaths = pathsto;
+        al->fullcollect = MAX(2 * (al->noldnodes + al->noldpaths),
+                ARENA_CHUNKLEN);
+        al->stats.full_collections++;
+    }
+
+    al->stats.nodes_live = al->noldnodes;
+    al->stats.pathnodes_live = al->noldpaths;
+    al->stats.collections++;
+}
+
+
+struct alignment *alignment_create(struct swlist *swl, timestamp_t tolerance)
 {
     struct alignment *al = xmalloc(sizeof *al);
+    size_t nodesize = sizeof (struct alnode);
+    size_t pathsize = sizeof (struct alpathnode);
     *al = (struct alignment) {
-        .alloc = pool_allocator_create(sizeof (struct alnode), 256),
-        .pnalloc = pool_allocator_create(sizeof (struct alpathnode), 256)
+        .nodes = fixed_allocator_create(nodesize, ARENA_CHUNKLEN),
+        .paths = fixed_allocator_create(pathsize, ARENA_CHUNKLEN),
+        .oldnodes = fixed_allocator_create(nodesize, ARENA_CHUNKLEN),
+        .oldpaths = fixed_allocator_create(pathsize, ARENA_CHUNKLEN),
+        .fullcollect = ARENA_CHUNKLEN,
+        .empty = {
+            .ispath = true,
+            .minscore = 0,
+            .maxscore = 0,
+            .tail = NULL
+        },
+        .tolerance = tolerance
     };
 
     al->width = 1;
     while (al->width < swl->length)
         al->width *= 2;
 
-    al->empty = pool_alloc(al->alloc);
-    *al->empty = (struct alnode) {
-        .ispath = true,
-        .minscore = 0,
-        .maxscore = 0,
-        .refcount = 1,
-        .tail = NULL
-    };
-
-    al->pathes = ref(al->empty);
+    al->pathes = &al->empty;
 
     return al;
 }
 
 void alignment_delete(struct alignment *al)
 {
-    unref(al->pathes, al);
-    unref(al->empty, al);
-
-    pool_allocator_delete(al->alloc);
-    pool_allocator_delete(al->pnalloc);
+    fixed_allocator_delete(al->nodes);
+    fixed_allocator_delete(al->paths);
+    fixed_allocator_delete(al->oldnodes);
+    fixed_allocator_delete(al->oldpaths);
+    free(al->nodepathes);
     free(al);
 }
 
@@ -275,71 +389,73 @@ static void dump_tree(struct alnode *tree, unsigned width, unsigned pos)
 
 void alignment_add_lattice(struct alignment *al, struct lattice *lat)
 {
-    // list of lattice nodes with all predecesors already processed
-    struct latnode *ready = NULL;
-
-    // init ready list and init pathes for these nodes
-    FOREACH(struct latnode, node, lat->nodelist, next) {
-        node->nentries_remain = node->nentries;
-        if (node->nentries_remain == 0) {
-            node->ready_next = ready;
-            ready = node;
-            node->pathes = ref(al->pathes);
-        } else {
-            node->pathes = ref(al->empty);
-        }
-    }
+    // nothing recognized, keep pathes of previous segments
+    if (lat->nnodes == 0) return;
+
+    // init pathes, nodes without entries continue the previous segments
+    if (lat->nnodes > al->maxnodes)
+        al->nodepathes = grow_array(al->nodepathes, sizeof *al->nodepathes,
+                &al->maxnodes, lat->nnodes);
+    struct alnode **nodepathes = al->nodepathes;
+    for (unsigned i = 0; i < lat->nnodes; i++)
+        nodepathes[i] = lat->nodes[i].nentries ? &al->empty : al->pathes;
 
     // reset al->pathes, will be used to store pathes at end of segment
-    unref(al->pathes, al);
-    al->pathes = ref(al->empty);
+    al->pathes = &al->empty;
+    al->generation++;
 
-    // traverse lattice
-    while (ready) {
-        struct latnode *node = ready;
-        ready = node->ready_next;
+    // traverse lattice, all predecessors of a node come before it
+    for (unsigned i = 0; i < lat->nnodes; i++) {
+        struct latnode *node = &lat->nodes[i];
+        const struct latlink *exits = lat->links + node->exits;
+        al->stats.latnodes++;
 
-        if (!node->exits_head) {
+        if (node->nexits == 0) {
 
             // add to post-segment result
-            if (node->pathes->maxscore > al->pathes->minscore) {
+            if (nodepathes[i]->maxscore > al->pathes->minscore) {
                 struct alnode *pathes =
-                        merge_tree(al->pathes, node->pathes, al);
-                if (pathes) {
-                    unref(al->pathes, al);
-                    al->pathes = pathes;
-                }
+                        merge_tree(al->pathes, nodepathes[i], al);
+                if (pathes) al->pathes = pathes;
             }
         }
         else {
             // todo: audio scores!
 
-            FOREACH(struct latlink, link, node->exits_head, exits_next) {
-                struct latnode *dest = link->to;
+            for (unsigned k = 0; k < node->nexits; k++) {
+                struct alnode **dest = &nodepathes[exits[k].to];
 
-                if (node->pathes->maxscore > dest->pathes->minscore) {
+                if (nodepathes[i]->maxscore > (*dest)->minscore) {
                     struct alnode *pathes =
-                            merge_tree(dest->pathes, node->pathes, al);
-                    if (pathes) {
-                        unref(dest->pathes, al);
-                        dest->pathes = pathes;
-                    }
+                            merge_tree(*dest, nodepathes[i], al);
+                    if (pathes) *dest = pathes;
                 }
-
-                if (--dest->nentries_remain == 0)
-                    dest->ready_next = ready, ready = dest;
             }
 
             if (node->word) {
-                FOREACH(struct swnode, swnode, node->word->subnodes, word_next) {
+                const struct swoccur *occur = node->word->occurs;
+                const struct swoccur *end = occur + node->word->noccurs;
+                if (al->tolerance)
+                    occur = swlist_occurrences(
+                            node->word, node->time, al->tolerance, &end);
+
+                for (; occur < end; occur++) {
+                    if (al->tolerance &&
+                            occur->maxendtime + al->tolerance < node->time)
+                        continue;
+
+                    struct swnode *swnode = occur->swnode;
                     struct alnode *base = NULL;
-                    if (swnode->position > 0)
+                    al->stats.candidates++;
+                    if (swnode->position > 0) {
+                        al->stats.lookups++;
                         base = tree_lookup(
-                                node->pathes, al->width, swnode->position - 1);
+                                nodepathes[i], al->width, swnode->position - 1);
+                    }
 
-                    struct alpathnode *tail = pool_alloc(al->pnalloc);
+                    struct alpathnode *tail = alloc_pathnode(al);
                     *tail = (struct alpathnode) {
-                        .refcount = 0,
+                        .generation = al->generation,
                         .time = node->time,
                         .swnode = swnode,
                         .pred = base ? base->tail : NULL };
@@ -347,56 +463,48 @@ void alignment_add_lattice(struct alignment *al, struct lattice *lat)
                     // tree node to reuse until it is actually stored in a tree
                     struct alnode *newpath = NULL;
 
-                    FOREACH(struct latlink, link, node->exits_head, exits_next) {
+                    for (unsigned k = 0; k < node->nexits; k++) {
 
                         // todo
                         unsigned score = base ? base->minscore + 1 : 1;
 
                         if (!newpath) {
-                            newpath = pool_alloc(al->alloc);
+                            newpath = alloc_node(al);
                             *newpath = (struct alnode) {
                                 .ispath = true,
+                                .generation = al->generation,
                                 .minscore = score, .maxscore = score,
-                                .refcount = 1,
                                 .tail = tail };
                         } else {
                             newpath->minscore = newpath->maxscore = score;
                         }
 
-                        struct latnode *dest = link->to;
+                        struct alnode **dest = &nodepathes[exits[k].to];
 
-                        if (newpath->minscore > dest->pathes->minscore) {
+                        if (newpath->minscore > (*dest)->minscore) {
                             struct alnode *pathes;
                             if (swnode->position == 0) {
                                 pathes = merge_path_complete(
-                                        dest->pathes, newpath, al);
+                                        *dest, newpath, al);
                             } else {
                                 pathes = merge_path_partial(
-                                        dest->pathes, al->width, newpath,
+                                        *dest, al->width, newpath,
                                         swnode->position, al);
                             }
 
                             if (pathes) {
-                                unref(dest->pathes, al);
-                                dest->pathes = pathes;
+                                *dest = pathes;
                                 newpath = NULL;
-                                tail->refcount++;
                             }
                         }
 
                     }
-                    // todo measure
-                    if (newpath) pool_free(newpath, al->alloc);
-
-                    if (tail->refcount == 0) pool_free(tail, al->pnalloc);
-                    else if (tail->pred) tail->pred->refcount++;
                 }
             }
         }
-
-        unref(node->pathes, al);
     }
 
+    collect(al);
 }
 
 
@@ -414,7 +522,26 @@ void alignment_dump_final(const struct alignment *al)
             pn = pn->pred;
         }
     }
+}
 
-    for (unsigned i = 0; i < sizeof cc / sizeof *cc; i++)
-        fprintf(stderr, "cc[%u]:%10u\n", i, cc[i]);
+const struct alignment_stats *alignment_get_stats(const struct alignment *al)
+{
+    return &al->stats;
+}
+
+void alignment_print_stats(const struct alignment *al, FILE *file)
+{
+    const struct alignment_stats *st = &al->stats;
+    fprintf(file, "alignment: %zu lattice nodes, %zu candidates, "
+            "%zu merges, %zu lookups\n", st->latnodes, st->candidates,
+            st->merges, st->lookups);
+    fprintf(file, "  tree nodes: %zu allocated, %zu peak (%.1f kB), "
+            "%zu live\n", st->nodes_allocated, st->nodes_peak,
+            st->nodes_peak * sizeof (struct alnode) / 1024.0, st->nodes_live);
+    fprintf(file, "  path nodes: %zu allocated, %zu peak (%.1f kB), "
+            "%zu live\n", st->pathnodes_allocated, st->pathnodes_peak,
+            st->pathnodes_peak * sizeof (struct alpathnode) / 1024.0,
+            st->pathnodes_live);
+    fprintf(file, "  collections: %zu, %zu full\n",
+            st->collections, st->full_collections);
 }
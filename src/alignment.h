@@ -6,38 +6,32 @@ struct swlist;
 struct lattice;
 
 
-struct alpathnode {
-    unsigned refcount;
-    timestamp_t time;
-    struct swnode *swnode;
-    struct alpathnode *pred; // null for beginning of path
+/*
+ * Best alignment pathes of the subtitles with the lattices so far, for
+ * each subtitle position. Implemented by alignment.c (binary persistent
+ * tree) and alignment_wide.c (8-way tree in index arenas), link either.
+ */
+struct alignment;
+
+struct alignment_stats {
+    size_t nodes_allocated;     // tree nodes
+    size_t nodes_live, nodes_peak;
+    size_t pathnodes_allocated; // elements of path chains
+    size_t pathnodes_live, pathnodes_peak;
+    size_t merges;              // calls of merge functions, with recursion
+    size_t lookups;             // tree lookups
+    size_t latnodes;            // lattice nodes processed
+    size_t candidates;          // subtitle occurrences of lattice words
+    size_t collections;         // of the arenas of a lattice (alignment.c)
+    size_t full_collections;    // including older path elements
 };
 
-struct alnode {
-    bool ispath;
-    unsigned minscore, maxscore; // same for path nodes
-    unsigned refcount;
-
-    union {
-        struct {
-            struct alnode *left, *right;
-        };
-        struct {
-            struct alpathnode *tail; // null for empty path
-        };
-    };
-};
-
-
-struct alignment {
-    struct pool_allocator *alloc;
-    struct pool_allocator *pnalloc;
-    struct alnode *pathes;
-    struct alnode *empty;
-    unsigned width;
-};
-
-struct alignment *alignment_create(struct swlist *swl);
+/*
+ * A lattice word is matched with the occurrences of the word in the
+ * subtitles within `tolerance` of its time, or all if it is 0. The words
+ * of `swl` have to be indexed (swlist_index).
+ */
+struct alignment *alignment_create(struct swlist *swl, timestamp_t tolerance);
 
 void alignment_delete(struct alignment *al);
 
@@ -45,6 +39,9 @@ void alignment_add_lattice(struct alignment *al, struct lattice *lat);
 
 void alignment_dump_final(const struct alignment *al);
 
+const struct alignment_stats *alignment_get_stats(const struct alignment *al);
+void alignment_print_stats(const struct alignment *al, FILE *file);
+
 
 
 
@@ -0,0 +1,644 @@
+/*
+ * Alternative implementation of alignment.h, link either this file or
+ * alignment.c. The pathes of all subtitle positions are kept in a
+ * persistent tree with FANOUT children per node instead of two, so an
+ * update copies about log8 instead of log2 (subtitle words) nodes. The
+ * score ranges of the children are stored in arrays of their parent and
+ * compared for a whole node at once. Tree nodes and path elements live in
+ * growable arrays and refer to each other by 32 bit index.
+ */
+#include "alignment.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "subwords.h"
+#include "lattice.h"
+#include "dict.h"
+
+#define FANOUT_BITS 3
+#define FANOUT (1u << FANOUT_BITS)
+
+/*
+ * Reference to a subtree: index of a tree node, or index of a path element
+ * with PATHREF set, which stands for the path ending with that element at
+ * all positions of the subtree. Path element 0 is the empty path.
+ */
+typedef uint32_t alref_t;
+
+#define PATHREF 0x80000000u
+#define EMPTYPATH PATHREF
+#define NOREF UINT32_MAX    // result of merges that change nothing
+
+struct alpathnode {
+    unsigned refcount;      // references from trees and successors
+    unsigned score;         // matched words
+    timestamp_t time;
+    uint32_t pred;          // 0 (empty path) for beginning of path,
+                            // next free element if unused
+    struct swnode *swnode;
+};
+
+/*
+ * Scores are increasing with the position, the maximum of a child is at
+ * most the minimum of the next one.
+ */
+struct alnode {
+    unsigned minscore[FANOUT], maxscore[FANOUT];
+    alref_t child[FANOUT];
+    unsigned refcount;      // next free node if unused
+};
+
+struct alignment {
+    struct alnode *nodes;
+    size_t maxnodes;
+    uint32_t nnodes, freenode;  // freenode NOREF if none
+
+    struct alpathnode *paths;
+    size_t maxpaths;
+    uint32_t npaths, freepath;  // freepath 0 if none
+
+    alref_t pathes;
+    unsigned shift;             // width of the tree is 1 << shift
+    timestamp_t tolerance;
+
+    alref_t *nodepathes;        // pathes of each lattice node
+    size_t maxlatnodes;
+
+    struct alignment_stats stats;
+};
+
+
+// bit mask of the children with a[c] > b[c], scores are below 2^31
+static inline unsigned mask_greater(const unsigned a[FANOUT],
+        const unsigned b[FANOUT])
+{
+    unsigned mask = 0;
+#ifdef __SSE2__
+    for (unsigned c = 0; c < FANOUT; c += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + c));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + c));
+        mask |= (unsigned)_mm_movemask_ps(
+                _mm_castsi128_ps(_mm_cmpgt_epi32(va, vb))) << c;
+    }
+#else
+    for (unsigned c = 0; c < FANOUT; c++)
+        mask |= (unsigned)(a[c] > b[c]) << c;
+#endif
+    return mask;
+}
+
+// number of children with maximum score at most `score`, they are a prefix
+static inline unsigned count_below(const unsigned maxscore[FANOUT],
+        unsigned score)
+{
+    unsigned mask = 0;
+#ifdef __SSE2__
+    __m128i vs = _mm_set1_epi32(score);
+    for (unsigned c = 0; c < FANOUT; c += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(maxscore + c));
+        mask |= (unsigned)_mm_movemask_ps(
+                _mm_castsi128_ps(_mm_cmpgt_epi32(v, vs))) << c;
+    }
+#else
+    for (unsigned c = 0; c < FANOUT; c++)
+        mask |= (unsigned)(maxscore[c] > score) << c;
+#endif
+    return mask ? (unsigned)__builtin_ctz(mask) : FANOUT;
+}
+
+// bit mask of the children that are the same in both nodes
+static inline unsigned mask_same(const alref_t a[FANOUT],
+        const alref_t b[FANOUT])
+{
+    unsigned mask = 0;
+#ifdef __SSE2__
+    for (unsigned c = 0; c < FANOUT; c += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + c));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + c));
+        mask |= (unsigned)_mm_movemask_ps(
+                _mm_castsi128_ps(_mm_cmpeq_epi32(va, vb))) << c;
+    }
+#else
+    for (unsigned c = 0; c < FANOUT; c++)
+        mask |= (unsigned)(a[c] == b[c]) << c;
+#endif
+    return mask;
+}
+
+
+// bit mask of the children that start a run of equal children
+static inline unsigned run_starts(const alref_t child[FANOUT])
+{
+    unsigned mask = 0;
+#ifdef __SSE2__
+    // the first child always differs from its "predecessor"
+    __m128i prev = _mm_set1_epi32(~child[0]);
+    for (unsigned c = 0; c < FANOUT; c += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(child + c));
+        __m128i shifted = _mm_or_si128(
+                _mm_slli_si128(v, 4), _mm_srli_si128(prev, 12));
+        mask |= (unsigned)_mm_movemask_ps(
+                _mm_castsi128_ps(_mm_cmpeq_epi32(v, shifted))) << c;
+        prev = v;
+    }
+    return ~mask & ((1u << FANOUT) - 1);
+#else
+    mask = 1;
+    for (unsigned c = 1; c < FANOUT; c++)
+        mask |= (unsigned)(child[c] != child[c - 1]) << c;
+    return mask;
+#endif
+}
+
+// length of the run starting at the lowest bit of `starts`
+static inline unsigned run_length(unsigned starts)
+{
+    unsigned rest = starts & (starts - 1);
+    return (rest ? (unsigned)__builtin_ctz(rest) : FANOUT) -
+            __builtin_ctz(starts);
+}
+
+static uint32_t alloc_node(struct alignment *al)
+{
+    struct alignment_stats *st = &al->stats;
+    st->nodes_allocated++;
+    st->nodes_live++;
+    st->nodes_peak = MAX(st->nodes_peak, st->nodes_live);
+
+    uint32_t n = al->freenode;
+    if (n != NOREF) {
+        al->freenode = al->nodes[n].refcount;
+        return n;
+    }
+    CHECK(al->nnodes < PATHREF);
+    if (al->nnodes == al->maxnodes)
+        al->nodes = grow_array(al->nodes, sizeof *al->nodes,
+                &al->maxnodes, al->nnodes + 1);
+    return al->nnodes++;
+}
+
+static inline void free_node(struct alignment *al, uint32_t n)
+{
+    al->stats.nodes_live--;
+    al->nodes[n].refcount = al->freenode;
+    al->freenode = n;
+}
+
+static uint32_t alloc_pathnode(struct alignment *al)
+{
+    struct alignment_stats *st = &al->stats;
+    st->pathnodes_allocated++;
+    st->pathnodes_live++;
+    st->pathnodes_peak = MAX(st->pathnodes_peak, st->pathnodes_live);
+
+    uint32_t p = al->freepath;
+    if (p) {
+        al->freepath = al->paths[p].pred;
+        return p;
+    }
+    CHECK(al->npaths < PATHREF - 1);
+    if (al->npaths == al->maxpaths)
+        al->paths = grow_array(al->paths, sizeof *al->paths,
+                &al->maxpaths, al->npaths + 1);
+    return al->npaths++;
+}
+
+static inline void free_pathnode(struct alignment *al, uint32_t p)
+{
+    al->stats.pathnodes_live--;
+    al->paths[p].pred = al->freepath;
+    al->freepath = p;
+}
+
+
+static inline alref_t ref(struct alignment *al, alref_t r, unsigned n)
+{
+    if (r & PATHREF) al->paths[r & ~PATHREF].refcount += n;
+    else al->nodes[r].refcount += n;
+    return r;
+}
+
+static void unref(struct alignment *al, alref_t r, unsigned n);
+
+// drops references to runs of the same child at once
+static void unref_children(struct alignment *al, const alref_t child[FANOUT])
+{
+    for (unsigned starts = run_starts(child); starts; starts &= starts - 1) {
+        alref_t r = child[__builtin_ctz(starts)];
+        unsigned n = run_length(starts);
+        unsigned *refcount = r & PATHREF ?
+                &al->paths[r & ~PATHREF].refcount : &al->nodes[r].refcount;
+        if (*refcount > n) *refcount -= n;
+        else unref(al, r, n);
+    }
+}
+
+// the empty path is never freed, the alignment keeps a reference to it
+static void unref(struct alignment *al, alref_t r, unsigned n)
+{
+    if (r & PATHREF) {
+        uint32_t p = r & ~PATHREF;
+        for (; (al->paths[p].refcount -= n) == 0; n = 1) {
+            uint32_t pred = al->paths[p].pred;
+            free_pathnode(al, p);
+            p = pred;
+        }
+    }
+    else if ((al->nodes[r].refcount -= n) == 0) {
+        unref_children(al, al->nodes[r].child);
+        free_node(al, r);
+    }
+}
+
+static inline unsigned minscore(const struct alignment *al, alref_t r)
+{
+    return r & PATHREF ?
+            al->paths[r & ~PATHREF].score : al->nodes[r].minscore[0];
+}
+
+static inline unsigned maxscore(const struct alignment *al, alref_t r)
+{
+    return r & PATHREF ?
+            al->paths[r & ~PATHREF].score : al->nodes[r].maxscore[FANOUT - 1];
+}
+
+static inline void set_child(const struct alignment *al, struct alnode *node,
+        unsigned c, alref_t r)
+{
+    node->child[c] = r;
+    node->minscore[c] = minscore(al, r);
+    node->maxscore[c] = maxscore(al, r);
+}
+
+static inline void set_path_child(struct alnode *node, unsigned c,
+        alref_t path, unsigned score)
+{
+    node->child[c] = path;
+    node->minscore[c] = node->maxscore[c] = score;
+}
+
+/*
+ * Gives the new node `n` its references: the ones to the children in
+ * `owned` are taken over from merge results, the others are added.
+ */
+static alref_t finish_node(struct alignment *al, uint32_t n, unsigned owned)
+{
+    struct alnode *node = &al->nodes[n];
+    for (unsigned starts = run_starts(node->child); starts;
+            starts &= starts - 1) {
+        unsigned c = __builtin_ctz(starts);
+        unsigned nrefs = run_length(starts);
+        unsigned runowned = owned >> c & ((1u << nrefs) - 1);
+        if (runowned) nrefs -= __builtin_popcount(runowned);
+        if (nrefs) ref(al, node->child[c], nrefs);
+    }
+    node->refcount = 1;
+    return n;
+}
+
+static uint32_t copy_node(struct alignment *al, alref_t into)
+{
+    uint32_t n = alloc_node(al);
+    al->nodes[n] = al->nodes[into];
+    return n;
+}
+
+/*
+ * The merges recurse before allocating their result node, so that they
+ * do not hold pointers into the node array while it can move.
+ */
+
+static alref_t merge_path_complete(struct alignment *al, alref_t into,
+        alref_t path, unsigned score)
+{
+    assert(path & PATHREF && score > minscore(al, into));
+    al->stats.merges++;
+
+    if (into & PATHREF || score >= maxscore(al, into))
+        return ref(al, path, 1);
+
+    // the path is better for a prefix of the children, and at least for
+    // the beginning of the next one
+    const struct alnode *node = &al->nodes[into];
+    unsigned n = count_below(node->maxscore, score);
+    alref_t child = node->minscore[n] < score ?
+            merge_path_complete(al, node->child[n], path, score) : NOREF;
+
+    uint32_t copy = copy_node(al, into);
+    for (unsigned c = 0; c < n; c++)
+        set_path_child(&al->nodes[copy], c, path, score);
+    if (child == NOREF) return finish_node(al, copy, 0);
+
+    set_child(al, &al->nodes[copy], n, child);
+    return finish_node(al, copy, 1u << n);
+}
+
+// splits the path `into` at `pos`, `path` is better from there on
+static alref_t merge_pathes(struct alignment *al, alref_t into,
+        unsigned shift, alref_t path, unsigned score, unsigned pos)
+{
+    assert(into & PATHREF && path & PATHREF &&
+            pos > 0 && pos < 1u << shift && score > minscore(al, into));
+    al->stats.merges++;
+
+    unsigned childshift = shift - FANOUT_BITS;
+    unsigned split = pos >> childshift;
+    unsigned offset = pos & ((1u << childshift) - 1);
+    alref_t child = offset ?
+            merge_pathes(al, into, childshift, path, score, offset) : NOREF;
+
+    uint32_t n = alloc_node(al);
+    struct alnode *node = &al->nodes[n];
+    unsigned intoscore = minscore(al, into);
+    for (unsigned c = 0; c < split; c++)
+        set_path_child(node, c, into, intoscore);
+    for (unsigned c = split; c < FANOUT; c++)
+        set_path_child(node, c, path, score);
+    if (child == NOREF) return finish_node(al, n, 0);
+
+    set_child(al, node, split, child);
+    return finish_node(al, n, 1u << split);
+}
+
+static alref_t merge_path_partial(struct alignment *al, alref_t into,
+        unsigned shift, alref_t path, unsigned score, unsigned pos)
+{
+    assert(path & PATHREF &&
+            pos > 0 && pos < 1u << shift && score > minscore(al, into));
+    al->stats.merges++;
+
+    if (into & PATHREF)
+        return merge_pathes(al, into, shift, path, score, pos);
+
+    unsigned childshift = shift - FANOUT_BITS;
+    unsigned split = pos >> childshift;
+    unsigned offset = pos & ((1u << childshift) - 1);
+
+    // the child with `pos`, then the later ones as in merge_path_complete
+    const struct alnode *node = &al->nodes[into];
+    unsigned n = MAX(count_below(node->maxscore, score), split + 1);
+    alref_t last = n < FANOUT && node->minscore[n] < score ?
+            node->child[n] : NOREF;
+
+    alref_t first = NOREF;
+    if (node->minscore[split] < score) {
+        first = offset ?
+                merge_path_partial(al, node->child[split], childshift,
+                        path, score, offset) :
+                merge_path_complete(al, node->child[split], path, score);
+    }
+    if (last != NOREF)
+        last = merge_path_complete(al, last, path, score);
+
+    if (first == NOREF && last == NOREF && n == split + 1)
+        return NOREF;
+
+    uint32_t copy = copy_node(al, into);
+    unsigned owned = 0;
+    if (first != NOREF) {
+        set_child(al, &al->nodes[copy], split, first);
+        owned |= 1u << split;
+    }
+    for (unsigned c = split + 1; c < n; c++)
+        set_path_child(&al->nodes[copy], c, path, score);
+    if (last != NOREF) {
+        set_child(al, &al->nodes[copy], n, last);
+        owned |= 1u << n;
+    }
+    return finish_node(al, copy, owned);
+}
+
+static alref_t merge_tree(struct alignment *al, alref_t into, alref_t tree)
+{
+    assert(maxscore(al, tree) > minscore(al, into));
+    al->stats.merges++;
+
+    if (minscore(al, tree) >= maxscore(al, into)) {
+        return ref(al, tree, 1);
+    }
+    else if (tree & PATHREF) {
+        return merge_path_complete(al, into, tree, minscore(al, tree));
+    }
+    else if (into & PATHREF) {
+        unsigned score = minscore(al, into);
+        if (score > minscore(al, tree))
+            return merge_path_complete(al, tree, into, score);
+        else
+            return ref(al, tree, 1);
+    }
+    else {
+        const struct alnode *node = &al->nodes[into];
+        const struct alnode *other = &al->nodes[tree];
+        unsigned todo = mask_greater(other->maxscore, node->minscore) &
+                ~mask_same(other->child, node->child);
+
+        alref_t children[FANOUT];
+        unsigned owned = 0;
+        for (; todo; todo &= todo - 1) {
+            unsigned c = __builtin_ctz(todo);
+            children[c] = merge_tree(al,
+                    al->nodes[into].child[c], al->nodes[tree].child[c]);
+            if (children[c] != NOREF) owned |= 1u << c;
+        }
+        if (!owned) return NOREF;
+
+        uint32_t copy = copy_node(al, into);
+        for (unsigned m = owned; m; m &= m - 1) {
+            unsigned c = __builtin_ctz(m);
+            set_child(al, &al->nodes[copy], c, children[c]);
+        }
+        return finish_node(al, copy, owned);
+    }
+}
+
+// path element of the best path at `pos`
+static uint32_t tree_lookup(const struct alignment *al, alref_t tree,
+        unsigned shift, unsigned pos)
+{
+    while (!(tree & PATHREF)) {
+        shift -= FANOUT_BITS;
+        tree = al->nodes[tree].child[pos >> shift];
+        pos &= (1u << shift) - 1;
+    }
+    return tree & ~PATHREF;
+}
+
+
+struct alignment *alignment_create(struct swlist *swl, timestamp_t tolerance)
+{
+    struct alignment *al = xmalloc(sizeof *al);
+    *al = (struct alignment) {
+        .freenode = NOREF,
+        .shift = FANOUT_BITS,
+        .tolerance = tolerance
+    };
+
+    while ((1u << al->shift) < swl->length)
+        al->shift += FANOUT_BITS;
+    CHECK(al->shift < 32);
+
+    // empty path, kept by the reference of al->pathes and this one
+    uint32_t empty = alloc_pathnode(al);
+    al->paths[empty] = (struct alpathnode) { .refcount = 2 };
+    al->pathes = EMPTYPATH;
+
+    return al;
+}
+
+void alignment_delete(struct alignment *al)
+{
+    free(al->nodes);
+    free(al->paths);
+    free(al->nodepathes);
+    free(al);
+}
+
+void alignment_add_lattice(struct alignment *al, struct lattice *lat)
+{
+    // nothing recognized, keep pathes of previous segments
+    if (lat->nnodes == 0) return;
+
+    // init pathes, nodes without entries continue the previous segments
+    if (lat->nnodes > al->maxlatnodes)
+        al->nodepathes = grow_array(al->nodepathes, sizeof *al->nodepathes,
+                &al->maxlatnodes, lat->nnodes);
+    alref_t *nodepathes = al->nodepathes;
+    unsigned nfirst = 0;
+    for (unsigned i = 0; i < lat->nnodes; i++) {
+        bool first = lat->nodes[i].nentries == 0;
+        nodepathes[i] = first ? al->pathes : EMPTYPATH;
+        nfirst += first;
+    }
+    ref(al, al->pathes, nfirst);
+    ref(al, EMPTYPATH, lat->nnodes - nfirst);
+
+    // reset al->pathes, will be used to store pathes at end of segment
+    unref(al, al->pathes, 1);
+    al->pathes = ref(al, EMPTYPATH, 1);
+
+    // traverse lattice, all predecessors of a node come before it
+    for (unsigned i = 0; i < lat->nnodes; i++) {
+        struct latnode *node = &lat->nodes[i];
+        const struct latlink *exits = lat->links + node->exits;
+        al->stats.latnodes++;
+
+        if (node->nexits == 0) {
+
+            // add to post-segment result
+            if (maxscore(al, nodepathes[i]) > minscore(al, al->pathes)) {
+                alref_t pathes = merge_tree(al, al->pathes, nodepathes[i]);
+                if (pathes != NOREF) {
+                    unref(al, al->pathes, 1);
+                    al->pathes = pathes;
+                }
+            }
+        }
+        else {
+            for (unsigned k = 0; k < node->nexits; k++) {
+                alref_t *dest = &nodepathes[exits[k].to];
+
+                if (maxscore(al, nodepathes[i]) > minscore(al, *dest)) {
+                    alref_t pathes = merge_tree(al, *dest, nodepathes[i]);
+                    if (pathes != NOREF) {
+                        unref(al, *dest, 1);
+                        *dest = pathes;
+                    }
+                }
+            }
+
+            if (node->word) {
+                const struct swoccur *occur = node->word->occurs;
+                const struct swoccur *end = occur + node->word->noccurs;
+                if (al->tolerance)
+                    occur = swlist_occurrences(
+                            node->word, node->time, al->tolerance, &end);
+
+                for (; occur < end; occur++) {
+                    if (al->tolerance &&
+                            occur->maxendtime + al->tolerance < node->time)
+                        continue;
+
+                    struct swnode *swnode = occur->swnode;
+                    uint32_t base = 0;
+                    al->stats.candidates++;
+                    if (swnode->position > 0) {
+                        al->stats.lookups++;
+                        base = tree_lookup(al, nodepathes[i], al->shift,
+                                swnode->position - 1);
+                    }
+
+                    unsigned score = al->paths[base].score + 1;
+                    uint32_t tail = alloc_pathnode(al);
+                    al->paths[tail] = (struct alpathnode) {
+                        .refcount = 0,
+                        .score = score,
+                        .time = node->time,
+                        .pred = base,
+                        .swnode = swnode };
+
+                    for (unsigned k = 0; k < node->nexits; k++) {
+                        alref_t *dest = &nodepathes[exits[k].to];
+
+                        if (score > minscore(al, *dest)) {
+                            alref_t pathes = swnode->position == 0 ?
+                                    merge_path_complete(al, *dest,
+                                            tail | PATHREF, score) :
+                                    merge_path_partial(al, *dest, al->shift,
+                                            tail | PATHREF, score,
+                                            swnode->position);
+
+                            if (pathes != NOREF) {
+                                unref(al, *dest, 1);
+                                *dest = pathes;
+                            }
+                        }
+                    }
+
+                    if (al->paths[tail].refcount == 0)
+                        free_pathnode(al, tail);
+                    else
+                        al->paths[base].refcount++;
+                }
+            }
+        }
+
+        unref(al, nodepathes[i], 1);
+    }
+}
+
+
+void alignment_dump_final(const struct alignment *al)
+{
+    uint32_t p = tree_lookup(al, al->pathes, al->shift, (1u << al->shift) - 1);
+    while (p) {
+        const struct alpathnode *pn = &al->paths[p];
+        printf("%u:%02u.%02u: %s (%.2f)\n",
+                pn->time / 60000, pn->time / 1000 % 60, pn->time / 10 % 100,
+                pn->swnode->word->string,
+                ((double)pn->time - pn->swnode->minstarttime) / ((double)pn->swnode->maxendtime - pn->swnode->minstarttime));
+
+        p = pn->pred;
+    }
+}
+
+const struct alignment_stats *alignment_get_stats(const struct alignment *al)
+{
+    return &al->stats;
+}
+
+void alignment_print_stats(const struct alignment *al, FILE *file)
+{
+    const struct alignment_stats *st = &al->stats;
+    fprintf(file, "alignment: %zu lattice nodes, %zu candidates, "
+            "%zu merges, %zu lookups\n", st->latnodes, st->candidates,
+            st->merges, st->lookups);
+    fprintf(file, "  tree nodes: %zu allocated, %zu peak (%.1f kB), "
+            "%zu live\n", st->nodes_allocated, st->nodes_peak,
+            st->nodes_peak * sizeof (struct alnode) / 1024.0, st->nodes_live);
+    fprintf(file, "  path nodes: %zu allocated, %zu peak (%.1f kB), "
+            "%zu live\n", st->pathnodes_allocated, st->pathnodes_peak,
+            st->pathnodes_peak * sizeof (struct alpathnode) / 1024.0,
+            st->pathnodes_live);
+}
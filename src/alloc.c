@@ -5,6 +5,7 @@ struct fixed_allocator {
     size_t chunklen;
     struct chunk *chunks;
     size_t pos;
+    struct chunk *spare;    // chunks kept by fixed_allocator_clear
 };
 
 struct pool_allocator {
@@ -35,14 +36,30 @@ void fixed_allocator_delete(fixed_allocator_t *al)
 {
     FOREACH(struct chunk, chunk, al->chunks, next)
         free(chunk);
+    FOREACH(struct chunk, chunk, al->spare, next)
+        free(chunk);
     free(al);
 }
 
+void fixed_allocator_clear(fixed_allocator_t *al)
+{
+    if (!al->chunks) return;
+
+    struct chunk *last = al->chunks;
+    while (last->next) last = last->next;
+    last->next = al->spare;
+    al->spare = al->chunks;
+    al->chunks = NULL;
+}
+
 void *fixed_alloc(fixed_allocator_t *al)
 {
     if (!al->chunks || al->pos >= al->chunklen) {
-        struct chunk *chunk =
-                xmalloc(sizeof *chunk + al->chunklen * al->membsize);
+        struct chunk *chunk = al->spare;
+        if (chunk)
+            al->spare = chunk->next;
+        else
+            chunk = xmalloc(sizeof *chunk + al->chunklen * al->membsize);
         chunk->next = al->chunks;
         al->chunks = chunk;
         al->pos = 0;
@@ -11,6 +11,9 @@ fixed_allocator_t *fixed_allocator_create(size_t membsize, size_t chunklen);
 void fixed_allocator_delete(fixed_allocator_t *al);
 void *fixed_alloc(fixed_allocator_t *al);
 
+// frees all objects at once, the memory is reused by later allocations
+void fixed_allocator_clear(fixed_allocator_t *al);
+
 pool_allocator_t *pool_allocator_create(size_t membsize, size_t chunklen);
 void pool_allocator_delete(pool_allocator_t *al);
 void *pool_alloc(pool_allocator_t *al);
@@ -3,6 +3,7 @@
 
 #include "common.h"
 
+// implemented by aqueue.c (mutex) and aqueue_lockfree.c (atomics)
 struct aqueue;
 
 struct aqueue *aqueue_create(size_t length);
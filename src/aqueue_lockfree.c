@@ -0,0 +1,183 @@
+/*
+ * Alternative implementation of aqueue.h using atomics, link either this
+ * file or aqueue.c. Push and pop do not take a lock unless the slot they
+ * need is not ready, only then threads are parked on a condition variable.
+ */
+#include "aqueue.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+
+#define SPIN_COUNT 64
+
+/*
+ * The slot for position `pos` is at index `pos & mask`. Its sequence
+ * number is `pos` when it is free for the item at `pos`, `pos + 1` when
+ * it holds that item, and becomes `pos + length` when the item is popped.
+ * The length is a power of two, so that slot indices and sequence numbers
+ * stay consistent when positions wrap around.
+ */
+struct slot {
+    atomic_uint seq;
+    void *item;
+};
+
+struct aqueue {
+    size_t length;
+    unsigned mask;                  // length - 1
+    atomic_uint pos;                // position of next item to pop
+    atomic_bool closed;
+
+    // number of parked threads, changed with mutex held
+    atomic_uint npushwait, npopwait;
+    pthread_cond_t pushwait, popwait;
+    pthread_mutex_t mutex;
+
+    struct slot slots[];
+};
+
+struct aqueue *aqueue_create(size_t minlength)
+{
+    // with one slot, a free slot for `pos + 1` would look filled for `pos`
+    size_t length = 2;
+    while (length < minlength) length *= 2;
+
+    struct aqueue *q = xmalloc(sizeof *q + length * sizeof *q->slots);
+    q->length = length;
+    q->mask = length - 1;
+    atomic_init(&q->pos, 0);
+    atomic_init(&q->closed, false);
+    atomic_init(&q->npushwait, 0);
+    atomic_init(&q->npopwait, 0);
+
+    for (size_t i = 0; i < length; i++) {
+        atomic_init(&q->slots[i].seq, i);
+        q->slots[i].item = NULL;
+    }
+
+    CHECK(!pthread_mutex_init(&q->mutex, NULL));
+    CHECK(!pthread_cond_init(&q->pushwait, NULL));
+    CHECK(!pthread_cond_init(&q->popwait, NULL));
+
+    return q;
+}
+
+void aqueue_delete(struct aqueue *q, void (*destructor)(void*))
+{
+    if (destructor)
+        for (size_t i = 0; i < q->length; i++)
+            if (q->slots[i].item)
+                destructor(q->slots[i].item);
+
+    pthread_cond_destroy(&q->pushwait);
+    pthread_cond_destroy(&q->popwait);
+    pthread_mutex_destroy(&q->mutex);
+    free(q);
+}
+
+
+// waits until `ready(q, arg)` or queue closed, returns false if closed
+static bool wait_for(struct aqueue *q,
+        bool (*ready)(struct aqueue *q, unsigned arg), unsigned arg,
+        atomic_uint *nwaiting, pthread_cond_t *cond)
+{
+    for (unsigned i = 0; i < SPIN_COUNT; i++) {
+        if (ready(q, arg)) return true;
+        if (atomic_load(&q->closed)) return false;
+        sched_yield();
+    }
+
+    CHECK(!pthread_mutex_lock(&q->mutex));
+
+    // the waiter count is incremented before the condition is checked
+    // again, so that the thread making it true will see the waiter
+    atomic_fetch_add(nwaiting, 1);
+    bool isready;
+    while (!(isready = ready(q, arg)) && !atomic_load(&q->closed))
+        CHECK(!pthread_cond_wait(cond, &q->mutex));
+    atomic_fetch_sub(nwaiting, 1);
+
+    pthread_mutex_unlock(&q->mutex);
+    return isready;
+}
+
+static void wake(struct aqueue *q, atomic_uint *nwaiting, pthread_cond_t *cond)
+{
+    if (atomic_load(nwaiting) > 0) {
+        CHECK(!pthread_mutex_lock(&q->mutex));
+        CHECK(!pthread_cond_broadcast(cond));
+        pthread_mutex_unlock(&q->mutex);
+    }
+}
+
+
+static bool slot_free(struct aqueue *q, unsigned pos)
+{
+    struct slot *slot = &q->slots[pos & q->mask];
+    return atomic_load(&slot->seq) == pos;
+}
+
+bool aqueue_push(struct aqueue *q, void *item, unsigned pos)
+{
+    assert(item);
+
+    if (atomic_load(&q->closed)) return false;
+    if (!slot_free(q, pos) &&
+            !wait_for(q, slot_free, pos, &q->npushwait, &q->pushwait))
+        return false;
+
+    struct slot *slot = &q->slots[pos & q->mask];
+    slot->item = item;
+    atomic_store(&slot->seq, pos + 1);
+
+    wake(q, &q->npopwait, &q->popwait);
+    return true;
+}
+
+
+static bool next_filled(struct aqueue *q, unsigned unused)
+{
+    (void)unused;
+    unsigned pos = atomic_load(&q->pos);
+    return atomic_load(&q->slots[pos & q->mask].seq) == pos + 1;
+}
+
+void *aqueue_pop(struct aqueue *q, unsigned *pos)
+{
+    for (;;) {
+        unsigned p = atomic_load(&q->pos);
+        struct slot *slot = &q->slots[p & q->mask];
+        unsigned seq = atomic_load(&slot->seq);
+
+        if (seq == p + 1) {
+            // item available, try to claim it
+            if (!atomic_compare_exchange_weak(&q->pos, &p, p + 1))
+                continue;
+
+            void *item = slot->item;
+            slot->item = NULL;
+            atomic_store(&slot->seq, p + q->length);
+
+            wake(q, &q->npushwait, &q->pushwait);
+            if (pos) *pos = p;
+            return item;
+        }
+        else if ((int)(seq - (p + 1)) < 0) {
+            // slot not filled yet
+            if (!wait_for(q, next_filled, 0, &q->npopwait, &q->popwait))
+                return NULL;
+        }
+        // otherwise the item was taken by another thread, retry
+    }
+}
+
+void aqueue_close(struct aqueue *q)
+{
+    atomic_store(&q->closed, true);
+
+    CHECK(!pthread_mutex_lock(&q->mutex));
+    pthread_cond_broadcast(&q->pushwait);
+    pthread_cond_broadcast(&q->popwait);
+    pthread_mutex_unlock(&q->mutex);
+}
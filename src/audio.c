@@ -1,187 +1,402 @@
 #include "audio.h"
 
-#include <float.h>
+#include <sys/mman.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
 
-struct audiosplitter {
 
-    size_t blocklen;
-    struct audioblock *(*getblock)(void *userptr);
-    void *getblock_userptr;
+typedef float sum_squares_func(
+        size_t length, const int16_t samples[length], int16_t prev_sample);
+
+
+/*
+ * Energy of the pre-emphasized block, i.e. the sum of squares of the first
+ * differences. Portable version, with independent accumulators so that the
+ * additions do not form one long dependency chain.
+ */
+static float sum_squares_preemph_scalar(
+        size_t length, const int16_t samples[length], int16_t prev_sample)
+{
+    float sum[4] = { 0.0f };
+    int prev = prev_sample;
+
+    size_t i = 0;
+    for (; i + 4 <= length; i += 4) {
+        for (int j = 0; j < 4; j++) {
+            float diff = samples[i + j] - (j ? samples[i + j - 1] : prev);
+            sum[j] += diff * diff;
+        }
+        prev = samples[i + 3];
+    }
+
+    for (; i < length; i++) {
+        float diff = samples[i] - prev;
+        sum[0] += diff * diff;
+        prev = samples[i];
+    }
+
+    return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+}
+
+#ifdef HAVE_X86_SIMD
 
-    // number of currently buffered blocks, <= skiplen + scanlen
-    size_t nblocks;
+__attribute__ ((target ("sse2")))
+static inline __m128 sse2_diff_squared(__m128i cur, __m128i prev, bool high)
+{
+    // sign-extend to 32 bit, the difference does not fit into 16 bit
+    __m128i c = high ? _mm_unpackhi_epi16(cur, cur) :
+            _mm_unpacklo_epi16(cur, cur);
+    __m128i p = high ? _mm_unpackhi_epi16(prev, prev) :
+            _mm_unpacklo_epi16(prev, prev);
+    __m128 diff = _mm_cvtepi32_ps(_mm_sub_epi32(
+            _mm_srai_epi32(c, 16), _mm_srai_epi32(p, 16)));
+    return _mm_mul_ps(diff, diff);
+}
 
-    // linked list of the `nblocks` buffered blocks, not terminated
-    struct audioblock *blocks;
+__attribute__ ((target ("sse2")))
+static float sum_squares_preemph_sse2(
+        size_t length, const int16_t samples[length], int16_t prev_sample)
+{
+    if (length == 0) return 0.0f;
+
+    // the first difference uses prev_sample, then loads are offset by one
+    float diff = samples[0] - prev_sample;
+    float sum = diff * diff;
+
+    __m128 acc[4] = { _mm_setzero_ps(), _mm_setzero_ps(),
+                      _mm_setzero_ps(), _mm_setzero_ps() };
+    size_t i = 1;
+    for (; i + 16 <= length; i += 16) {
+        for (int j = 0; j < 2; j++) {
+            const int16_t *p = samples + i + j * 8;
+            __m128i cur = _mm_loadu_si128((const __m128i*)p);
+            __m128i prev = _mm_loadu_si128((const __m128i*)(p - 1));
+            acc[2 * j] = _mm_add_ps(acc[2 * j],
+                    sse2_diff_squared(cur, prev, false));
+            acc[2 * j + 1] = _mm_add_ps(acc[2 * j + 1],
+                    sse2_diff_squared(cur, prev, true));
+        }
+    }
 
-    // append address for `blocks` list.
-    struct audioblock **blocks_append;
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(
+            _mm_add_ps(acc[0], acc[1]), _mm_add_ps(acc[2], acc[3])));
+    sum += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
 
-    // number of buffered blocks that are not considered for split
-    // point search, because the created segment would be too short.
-    size_t skiplen;
+    if (i < length)
+        sum += sum_squares_preemph_scalar(
+                length - i, samples + i, samples[i - 1]);
+    return sum;
+}
 
-    // number of buffered blocks after `skiplen` that are considered for search.
-    size_t scanlen;
+// squared differences of the 8 samples at p and their predecessors
+__attribute__ ((target ("avx2")))
+static inline __m256 avx2_diff_squared(const int16_t *p)
+{
+    __m256i cur = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)p));
+    __m256i prev = _mm256_cvtepi16_epi32(
+            _mm_loadu_si128((const __m128i*)(p - 1)));
+    __m256 diff = _mm256_cvtepi32_ps(_mm256_sub_epi32(cur, prev));
+    return _mm256_mul_ps(diff, diff);
+}
+
+/*
+ * The accumulators are separate variables, as an array they are kept in
+ * memory. The last differences are taken from the final 8 samples, with
+ * the lanes already summed masked out, so that no scalar tail (and no call
+ * into non-VEX code) is needed.
+ */
+__attribute__ ((target ("avx2")))
+static float sum_squares_preemph_avx2(
+        size_t length, const int16_t samples[length], int16_t prev_sample)
+{
+    float sum = 0.0f;
+    int prev = prev_sample;
+    if (length < 9) {
+        for (size_t i = 0; i < length; i++) {
+            float diff = samples[i] - prev;
+            sum += diff * diff;
+            prev = samples[i];
+        }
+        return sum;
+    }
+
+    float diff = samples[0] - prev;
+    sum = diff * diff;
+
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+    size_t i = 1;
+    for (; i + 32 <= length; i += 32) {
+        acc0 = _mm256_add_ps(acc0, avx2_diff_squared(samples + i));
+        acc1 = _mm256_add_ps(acc1, avx2_diff_squared(samples + i + 8));
+        acc2 = _mm256_add_ps(acc2, avx2_diff_squared(samples + i + 16));
+        acc3 = _mm256_add_ps(acc3, avx2_diff_squared(samples + i + 24));
+    }
+    for (; i + 8 <= length; i += 8)
+        acc0 = _mm256_add_ps(acc0, avx2_diff_squared(samples + i));
+
+    if (i < length) {
+        size_t last = length - 8;
+        __m256i index = _mm256_add_epi32(_mm256_set1_epi32(last),
+                _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        __m256 keep = _mm256_castsi256_ps(
+                _mm256_cmpgt_epi32(index, _mm256_set1_epi32(i - 1)));
+        acc1 = _mm256_add_ps(acc1,
+                _mm256_and_ps(keep, avx2_diff_squared(samples + last)));
+    }
+
+    __m256 acc8 = _mm256_add_ps(
+            _mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3));
+    __m128 acc4 = _mm_add_ps(_mm256_castps256_ps128(acc8),
+            _mm256_extractf128_ps(acc8, 1));
+    float lanes[4];
+    _mm_storeu_ps(lanes, acc4);
+    return sum + (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+#endif
+
+static sum_squares_func *select_sum_squares_preemph(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return sum_squares_preemph_avx2;
+    if (__builtin_cpu_supports("sse2")) return sum_squares_preemph_sse2;
+#endif
+    return sum_squares_preemph_scalar;
+}
+
+
+/*
+ * Possible split point, between the blocks at `pos - 1` and `pos`.
+ */
+struct splitpoint {
+    size_t pos;     // block position since start of stream
+    float value;    // MAX of the powers of the two adjacent blocks
+};
+
+struct audiosplitter {
+
+    size_t blocklen;
+    size_t segmin, segmax;
+    bool (*getblock)(int16_t *samples, struct blockinfo *info, void *userptr);
+    void *getblock_userptr;
+
+    // buffered blocks, with capacity for segmax + 1 blocks.
+    // handed out as segment, only the remaining blocks are copied.
+    struct audiosegment *buffer;
+
+    // position of the first buffered block since start of stream
+    size_t start;
 
     // Last sample of most recently read block. Used for pre-emphasis.
     int16_t prev_sample;
 
-    // ring buffer of size `scanlen` containing the powers of buffered
-    // blocks to consider for split point search.
-    float *scanbuf;
+    // power of most recently read block
+    float prev_power;
 
-    // current start position within ring buffer.
-    size_t offset;
+    // energy kernel selected for the running cpu
+    sum_squares_func *sum_squares_preemph;
+
+    // Ring buffer of split points in increasing order of position and
+    // strictly increasing value, i.e. the first one is the minimum of all
+    // split points at or after its position (sliding window minimum).
+    struct splitpoint *splitpoints;
+    size_t sp_capacity, sp_first, sp_count;
+
+    // thresholds for early split at silences, per block, 0 if disabled
+    float silence_low, silence_high;
+    bool silence_seen;
 };
 
 
+void audiosegment_delete(struct audiosegment *seg)
+{
+    if (!seg) return;
+    free(seg->blocks);
+    if (seg->mapsize)
+        munmap(seg, seg->mapsize);
+    else
+        free(seg);
+}
+
+static struct audiosegment *create_buffer(const struct audiosplitter *sp)
+{
+    size_t capacity = sp->segmax + 1;
+    struct audiosegment *buf = xmalloc(sizeof *buf +
+            capacity * sp->blocklen * sizeof *buf->samples);
+    *buf = (struct audiosegment) {
+        .blocklen = sp->blocklen,
+        .blocks = xmalloc(capacity * sizeof *buf->blocks)
+    };
+    return buf;
+}
+
+
 struct audiosplitter *audiosplitter_create(
         size_t blocklen, size_t segmin, size_t segmax,
-        struct audioblock *(*getblock)(void *userptr), void *userptr)
+        bool (*getblock)(int16_t *samples, struct blockinfo *info,
+                void *userptr),
+        void *userptr)
 {
     assert(segmin > 0 && segmax >= segmin);
 
     struct audiosplitter *sp = xmalloc(sizeof *sp);
     *sp = (struct audiosplitter) {
         .blocklen = blocklen,
+        .segmin = segmin,
+        .segmax = segmax,
         .getblock = getblock,
         .getblock_userptr = userptr,
-        .skiplen = segmin - 1,
-        .scanlen = segmax - segmin + 2,
-        .blocks_append = &sp->blocks
+        .sum_squares_preemph = select_sum_squares_preemph(),
+        .sp_capacity = segmax + 1
     };
 
-    sp->scanbuf = xmalloc(sp->scanlen * sizeof *sp->scanbuf);
+    sp->splitpoints = xmalloc(sp->sp_capacity * sizeof *sp->splitpoints);
+    sp->buffer = create_buffer(sp);
     return sp;
 }
 
 
-struct audioblock* audiosplitter_delete(struct audiosplitter *sp)
+void audiosplitter_set_silence(struct audiosplitter *sp,
+        float low, float high)
 {
-    struct audioblock *blocks = sp->blocks;
-    free(sp->scanbuf);
-    free(sp);
-    return blocks;
+    assert(high >= low);
+    sp->silence_low = low * sp->blocklen;
+    sp->silence_high = high * sp->blocklen;
 }
 
 
-static float sum_squares_preemph(
-        size_t length, int16_t samples[length], int16_t prev_sample)
+void audiosplitter_delete(struct audiosplitter *sp)
 {
-    float sum = 0.0f;
-    float fprev = prev_sample;
-    for (size_t i = 0; i < length; i++) {
-        float fsamp = samples[i];
-        sum += (fsamp - fprev) * (fsamp - fprev);
-        fprev = fsamp;
-    }
-    return sum;
+    audiosegment_delete(sp->buffer);
+    free(sp->splitpoints);
+    free(sp);
 }
 
 
-/**
- * Searches data stored in a ring buffer for position where two consecutive
- * values are minimal.
- * @param length length of the ring buffer, `length >= 2`.
- * @param ringbuf the completely filled ring buffer.
- * @param offset start index of the ring buffer, `offset < length`.
- * @return the split length `n` such that `0 < n < length` and
- *      `MAX(ringbuf[(offset + n - 1) % length], ringbuf[(offset + n) % length]`
- *      is minimal.
- */
-static size_t find_splitpoint(size_t length, const float ringbuf[length],
-        size_t offset)
+static inline struct splitpoint *splitpoint_at(
+        const struct audiosplitter *sp, size_t i)
 {
-    float min_val = FLT_MAX;
-    size_t min_pos = 1;
-
-    size_t offset_left = offset, offset_right;
-    float val_left = ringbuf[offset_left], val_right;
-
-    for (size_t i = 1; i < length; i++) {
-        offset_right = offset_left + 1;
-        if (offset_right == length) offset_right = 0;
-        val_right = ringbuf[offset_right];
-
-        float val = MAX(val_left, val_right);
-        if (val <= min_val) {
-            min_pos = i;
-            min_val = val;
-        }
-
-        offset_left = offset_right;
-        val_left = val_right;
-    }
-
-    return min_pos;
+    size_t idx = sp->sp_first + i;
+    if (idx >= sp->sp_capacity) idx -= sp->sp_capacity;
+    return &sp->splitpoints[idx];
 }
 
-
-static bool fill_buffer(struct audiosplitter *sp)
+static inline void pop_first_splitpoint(struct audiosplitter *sp)
 {
-    // refill blocks list
-    while (sp->nblocks < sp->skiplen + sp->scanlen) {
-
-        struct audioblock *block = sp->getblock(sp->getblock_userptr);
-        if (!block) return false;
+    assert(sp->sp_count > 0);
+    if (++sp->sp_first == sp->sp_capacity) sp->sp_first = 0;
+    sp->sp_count--;
+}
 
-        // append to list
-        sp->nblocks++;
-        *sp->blocks_append = block;
-        sp->blocks_append = &block->next;
+static void push_splitpoint(struct audiosplitter *sp, size_t pos, float value)
+{
+    // drop split points that can never be the minimum again. on equal
+    // values, the later split point is preferred.
+    while (sp->sp_count > 0 &&
+            splitpoint_at(sp, sp->sp_count - 1)->value >= value)
+        sp->sp_count--;
+
+    assert(sp->sp_count < sp->sp_capacity);
+    *splitpoint_at(sp, sp->sp_count++) = (struct splitpoint){ pos, value };
+}
 
-        // compute power
-        if (sp->nblocks >= sp->skiplen) {
-            size_t idx =
-                    (sp->nblocks - sp->skiplen + sp->offset) % sp->scanlen;
-            sp->scanbuf[idx] = //logf(
-                    sum_squares_preemph(sp->blocklen, block->samples, sp->prev_sample);
-                    // /    sp->blocklen;//);
-        }
+// returns length of segment up to best split point after segmin blocks
+static size_t take_best_splitpoint(struct audiosplitter *sp)
+{
+    // drop split points that would make the segment too short
+    while (splitpoint_at(sp, 0)->pos < sp->start + sp->segmin)
+        pop_first_splitpoint(sp);
 
-        sp->prev_sample = block->samples[sp->blocklen - 1];
-    }
-    return true;
+    size_t length = splitpoint_at(sp, 0)->pos - sp->start;
+    pop_first_splitpoint(sp);
+    return length;
 }
 
-// removes and returns a number of blocks from the list of buffer list
-static struct audioblock *remove_segment(
+
+// removes and returns a number of blocks from the buffer
+static struct audiosegment *remove_segment(
         struct audiosplitter *sp, size_t length)
 {
-    assert(length > 0 && length <= sp->nblocks);
-
-    // find end of segment
-    struct audioblock *first = sp->blocks;
-    struct audioblock *last = first;
-    for (size_t i = 1; i < length; i++)
-        last = last->next;
-
-    // shorten list of buffered blocks
-    sp->blocks = last->next;
-    sp->nblocks -= length;
-    if (sp->nblocks == 0) sp->blocks_append = &sp->blocks;
+    struct audiosegment *seg = sp->buffer;
+    assert(length > 0 && length <= seg->nblocks);
+
+    // move remaining blocks to new buffer
+    size_t rest = seg->nblocks - length;
+    sp->buffer = create_buffer(sp);
+    sp->buffer->nblocks = rest;
+    memcpy(sp->buffer->samples, seg->samples + length * sp->blocklen,
+            rest * sp->blocklen * sizeof *seg->samples);
+    memcpy(sp->buffer->blocks, seg->blocks + length,
+            rest * sizeof *seg->blocks);
+
+    sp->start += length;
+    sp->silence_seen = false;
+
+    // shrink and return segment, usually done in place
+    seg->nblocks = length;
+    seg->blocks = xrealloc(seg->blocks, length * sizeof *seg->blocks);
+    return xrealloc(seg, sizeof *seg +
+            length * sp->blocklen * sizeof *seg->samples);
+}
 
-    // advance ring buffer
-    sp->offset = (sp->offset + length) % sp->scanlen;
+/*
+ * Reads one block and registers the split point before it.
+ * Returns false at end of stream, or true with `*split` set if the
+ * segment should be split early at a silence.
+ */
+static bool read_block(struct audiosplitter *sp, bool *split)
+{
+    struct audiosegment *buf = sp->buffer;
+    size_t pos = buf->nblocks;
+    int16_t *samples = buf->samples + pos * sp->blocklen;
+
+    struct blockinfo *info = &buf->blocks[pos];
+    info->power = -1.0f;
+    if (!sp->getblock(samples, info, sp->getblock_userptr))
+        return false;
+
+    buf->nblocks++;
+
+    if (info->power < 0.0f)
+        info->power = //logf(
+                sp->sum_squares_preemph(sp->blocklen, samples, sp->prev_sample);
+                // /    sp->blocklen;//);
+    float power = info->power;
+
+    if (pos > 0 || sp->start > 0) {
+        float value = MAX(sp->prev_power, power);
+        push_splitpoint(sp, sp->start + pos, value);
+
+        // split after the silence, when power rises again
+        if (pos >= sp->segmin && value < sp->silence_low)
+            sp->silence_seen = true;
+        else if (sp->silence_seen && value > sp->silence_high)
+            *split = true;
+    }
 
-    // terminate and return segment
-    last->next = NULL;
-    return first;
+    sp->prev_sample = samples[sp->blocklen - 1];
+    sp->prev_power = power;
+    return true;
 }
 
-struct audioblock *audiosplitter_next_segment(struct audiosplitter *sp)
+struct audiosegment *audiosplitter_next_segment(struct audiosplitter *sp)
 {
-    if (fill_buffer(sp)) {
-        return remove_segment(sp, sp->skiplen +
-                    find_splitpoint(sp->scanlen, sp->scanbuf, sp->offset));
-    } else if (sp->nblocks > 0) {
-        // end of stream found, return all remaining blocks
-        return remove_segment(sp, sp->nblocks);
-    } else {
-        return NULL;
+    bool split = false;
+    while (sp->buffer->nblocks <= sp->segmax && !split) {
+        if (!read_block(sp, &split)) {
+            if (sp->buffer->nblocks == 0) return NULL;
+
+            // end of stream found, return all remaining blocks
+            return remove_segment(sp, sp->buffer->nblocks);
+        }
     }
+
+    return remove_segment(sp, take_best_splitpoint(sp));
 }
 
 
@@ -3,21 +3,50 @@
 
 #include "common.h"
 
-struct audioblock {
-    timestamp_t starttime; // presentation time, in ms
-    struct audioblock *next;
-    int16_t samples[];  // same fixed size for all blocks, append zeroes at end
+struct blockinfo {
+    timestamp_t starttime;   // presentation time, in ms
+    float power;             // energy of pre-emphasized samples
 };
 
+/*
+ * Audio segment, stored as one contiguous buffer of fixed size blocks.
+ */
+struct audiosegment {
+    size_t nblocks;
+    size_t blocklen;
+    size_t mapsize;          // size of memory mapping, 0 if allocated
+    struct blockinfo *blocks;
+    int16_t samples[];       // nblocks * blocklen samples, zeroes at end
+};
+
+void audiosegment_delete(struct audiosegment *seg);
+
+
+/*
+ * The splitter reads blocks through `getblock`, which returns false at end
+ * of stream. It sets the start time of the block, and can set its power
+ * if already known. Otherwise the power is negative and computed here.
+ */
 struct audiosplitter;
 
 struct audiosplitter *audiosplitter_create(
         size_t blocklen, size_t segmin, size_t segmax,
-        struct audioblock *(*getblock)(void *userptr), void *userptr);
-
-struct audioblock *audiosplitter_delete(struct audiosplitter *sp);
-
-struct audioblock *audiosplitter_next_segment(struct audiosplitter *sp);
+        bool (*getblock)(int16_t *samples, struct blockinfo *info,
+                void *userptr),
+        void *userptr);
+
+void audiosplitter_delete(struct audiosplitter *sp);
+
+/*
+ * Enables early splits at silences: instead of waiting for `segmax`
+ * blocks, a segment of at least `segmin` blocks is split as soon as the
+ * power drops below `low` and afterwards rises above `high` again.
+ * Thresholds are mean squares of pre-emphasized samples, 0 disables.
+ */
+void audiosplitter_set_silence(struct audiosplitter *sp,
+        float low, float high);
+
+struct audiosegment *audiosplitter_next_segment(struct audiosplitter *sp);
 
 
 
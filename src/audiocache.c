@@ -0,0 +1,305 @@
+#include "audiocache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "audio.h"
+#include "waveout.h"
+
+#define INDEX_MAGIC "vsubac01"
+#define INDEX_CHUNK "vsix"
+#define BYTEORDER 0x01020304
+
+/*
+ * Header of the index chunk, followed by the source path, padded to 8
+ * bytes, and the block infos. The index is stored in native byte order,
+ * files from machines with another byte order fail the key check.
+ */
+struct indexheader {
+    char magic[8];
+    uint32_t byteorder;
+    uint32_t audiostream;
+    uint64_t filesize;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t samplerate;
+    uint32_t blocklen;
+    uint64_t nblocks;
+    uint32_t pathlen;
+    uint32_t reserved;
+};
+
+#define PAD8(n) (((n) + 7) & ~(size_t)7)
+
+
+static inline uint32_t rdle32(const uint8_t buf[4])
+{
+    return buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t)buf[3] << 24;
+}
+
+
+// key of the source file, with nblocks 0
+static bool make_key(struct indexheader *key, char path[PATH_MAX],
+        const char *infilename, unsigned audiostream,
+        unsigned samplerate, unsigned blocklen)
+{
+    struct stat st;
+    if (stat(infilename, &st) || !realpath(infilename, path))
+        return false;
+
+    *key = (struct indexheader) {
+        .byteorder = BYTEORDER,
+        .audiostream = audiostream,
+        .filesize = st.st_size,
+        .mtime_sec = st.st_mtim.tv_sec,
+        .mtime_nsec = st.st_mtim.tv_nsec,
+        .samplerate = samplerate,
+        .blocklen = blocklen,
+        .pathlen = strlen(path)
+    };
+    memcpy(key->magic, INDEX_MAGIC, sizeof key->magic);
+    return true;
+}
+
+// cache file name from a hash (64 bit FNV-1a) of the path and the stream
+static char *cache_filename(const char *dir, const char *path,
+        unsigned audiostream)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const char *c = path; *c; c++)
+        hash = (hash ^ (uint8_t)*c) * 0x100000001b3;
+
+    size_t size = strlen(dir) + 40;
+    char *filename = xmalloc(size);
+    snprintf(filename, size, "%s/%016llx-%u.wav",
+            dir, (unsigned long long)hash, audiostream);
+    return filename;
+}
+
+
+// finds chunk in mapped RIFF file, returns pointer to its data or NULL
+static const uint8_t *find_chunk(const uint8_t *file, size_t filesize,
+        const char id[4], size_t *size)
+{
+    if (filesize < 12 || memcmp(file, "RIFF", 4) || memcmp(file + 8, "WAVE", 4))
+        return NULL;
+
+    size_t offset = 12;
+    while (offset + 8 <= filesize) {
+        size_t len = rdle32(file + offset + 4);
+        if (len > filesize - offset - 8) return NULL;
+        if (!memcmp(file + offset, id, 4)) {
+            *size = len;
+            return file + offset + 8;
+        }
+        offset += 8 + len + len % 2;
+    }
+    return NULL;
+}
+
+
+struct audiocache {
+    void *map;
+    size_t mapsize;
+    const uint8_t *samples;     // little endian samples of all blocks
+    const uint8_t *blocks;      // block infos, possibly unaligned
+    size_t blocklen;
+    size_t nblocks;
+    size_t next;                // next block to read
+};
+
+// checks the index and data chunks against the key
+static bool check_index(struct audiocache *ac, const struct indexheader *key,
+        const char *path)
+{
+    size_t datasize, indexsize;
+    const uint8_t *data = find_chunk(ac->map, ac->mapsize, "data", &datasize);
+    const uint8_t *index = find_chunk(
+            ac->map, ac->mapsize, INDEX_CHUNK, &indexsize);
+    if (!data || !index || indexsize < sizeof *key) return false;
+
+    struct indexheader header;
+    memcpy(&header, index, sizeof header);
+    size_t nblocks = header.nblocks;
+    header.nblocks = 0;
+    if (memcmp(&header, key, sizeof header)) return false;
+
+    size_t pathsize = PAD8(header.pathlen);
+    if (indexsize < sizeof header + pathsize +
+            nblocks * sizeof (struct blockinfo)) return false;
+    if (memcmp(index + sizeof header, path, header.pathlen)) return false;
+    if (datasize != nblocks * header.blocklen * 2) return false;
+
+    ac->samples = data;
+    ac->blocks = index + sizeof header + pathsize;
+    ac->blocklen = header.blocklen;
+    ac->nblocks = nblocks;
+    return true;
+}
+
+struct audiocache *audiocache_open(const char *dir, const char *infilename,
+        unsigned audiostream, unsigned samplerate, unsigned blocklen)
+{
+    struct indexheader key;
+    char path[PATH_MAX];
+    if (!make_key(&key, path, infilename, audiostream, samplerate, blocklen))
+        return NULL;
+
+    char *filename = cache_filename(dir, path, audiostream);
+    struct audiocache *ac = NULL;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            warning("Could not open cache file \"%s\": %s",
+                    filename, strerror(errno));
+        goto end;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size == 0) goto end;
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        warning("Could not map cache file \"%s\": %s",
+                filename, strerror(errno));
+        goto end;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    ac = xmalloc(sizeof *ac);
+    *ac = (struct audiocache) { .map = map, .mapsize = st.st_size };
+
+    if (!check_index(ac, &key, path)) {
+        warning("Ignoring stale cache file \"%s\"", filename);
+        audiocache_close(ac);
+        ac = NULL;
+    }
+
+end:
+    if (fd >= 0) close(fd);
+    free(filename);
+    return ac;
+}
+
+void audiocache_close(struct audiocache *ac)
+{
+    munmap(ac->map, ac->mapsize);
+    free(ac);
+}
+
+bool audiocache_getblock(int16_t *samples, struct blockinfo *info,
+        void *userptr)
+{
+    struct audiocache *ac = userptr;
+    if (ac->next == ac->nblocks) return false;
+
+    const uint8_t *src = ac->samples + ac->next * ac->blocklen * 2;
+    for (size_t i = 0; i < ac->blocklen; i++)
+        samples[i] = (int16_t)(src[2 * i] | src[2 * i + 1] << 8);
+
+    memcpy(info, ac->blocks + ac->next * sizeof *info, sizeof *info);
+    ac->next++;
+    return true;
+}
+
+
+
+struct audiocache_writer {
+    char *filename;
+    char *tmpfilename;
+    waveout_t *wf;
+    struct indexheader header;
+    char path[PATH_MAX];
+
+    struct blockinfo *blocks;
+    size_t nblocks, capacity;
+};
+
+struct audiocache_writer *audiocache_writer_create(const char *dir,
+        const char *infilename, unsigned audiostream,
+        unsigned samplerate, unsigned blocklen)
+{
+    struct audiocache_writer *w = xmalloc(sizeof *w);
+    *w = (struct audiocache_writer){0};
+
+    if (!make_key(&w->header, w->path,
+            infilename, audiostream, samplerate, blocklen)) {
+        warning("Not caching audio of \"%s\": %s",
+                infilename, strerror(errno));
+        free(w);
+        return NULL;
+    }
+
+    if (mkdir(dir, 0777) && errno != EEXIST)
+        warning("Could not create cache directory \"%s\": %s",
+                dir, strerror(errno));
+
+    w->filename = cache_filename(dir, w->path, audiostream);
+    size_t size = strlen(w->filename) + 32;
+    w->tmpfilename = xmalloc(size);
+    snprintf(w->tmpfilename, size, "%s.%ld.tmp",
+            w->filename, (long)getpid());
+
+    if (!(w->wf = waveout_open(w->tmpfilename, samplerate))) {
+        free(w->tmpfilename);
+        free(w->filename);
+        free(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+void audiocache_writer_add(struct audiocache_writer *w,
+        const struct audiosegment *seg)
+{
+    assert(seg->blocklen == w->header.blocklen);
+    waveout_write(w->wf, seg->samples, seg->nblocks * seg->blocklen);
+
+    if (w->nblocks + seg->nblocks > w->capacity)
+        w->blocks = grow_array(w->blocks, sizeof *w->blocks,
+                &w->capacity, w->nblocks + seg->nblocks);
+    memcpy(w->blocks + w->nblocks, seg->blocks,
+            seg->nblocks * sizeof *seg->blocks);
+    w->nblocks += seg->nblocks;
+}
+
+bool audiocache_writer_finish(struct audiocache_writer *w, bool commit)
+{
+    if (commit) {
+        size_t pathsize = PAD8(w->header.pathlen);
+        size_t size = sizeof w->header + pathsize +
+                w->nblocks * sizeof *w->blocks;
+        uint8_t *index = xmalloc(size);
+
+        w->header.nblocks = w->nblocks;
+        memcpy(index, &w->header, sizeof w->header);
+        memset(index + sizeof w->header, 0, pathsize);
+        memcpy(index + sizeof w->header, w->path, w->header.pathlen);
+        memcpy(index + sizeof w->header + pathsize,
+                w->blocks, w->nblocks * sizeof *w->blocks);
+
+        waveout_add_chunk(w->wf, INDEX_CHUNK, index, size);
+        free(index);
+    }
+
+    commit &= waveout_close(w->wf);
+
+    if (commit && rename(w->tmpfilename, w->filename)) {
+        warning("Could not rename cache file \"%s\": %s",
+                w->tmpfilename, strerror(errno));
+        commit = false;
+    }
+    if (!commit) unlink(w->tmpfilename);
+
+    free(w->blocks);
+    free(w->tmpfilename);
+    free(w->filename);
+    free(w);
+    return commit;
+}
@@ -0,0 +1,43 @@
+#ifndef AUDIOCACHE_H_
+#define AUDIOCACHE_H_
+
+#include "common.h"
+
+struct audiosegment;
+struct blockinfo;
+
+/*
+ * On-disk cache of decoded audio, one file per source file and audio
+ * stream in the cache directory. The file is a WAVE file with the samples
+ * of all blocks, followed by an index chunk holding the cache key (path,
+ * size and modification time of the source file, audio stream) and the
+ * start time and power of each block.
+ */
+
+struct audiocache;
+
+// opens the cache file, returns NULL if it does not exist or is stale
+struct audiocache *audiocache_open(const char *dir, const char *infilename,
+        unsigned audiostream, unsigned samplerate, unsigned blocklen);
+void audiocache_close(struct audiocache *ac);
+
+// block reader for audiosplitter, `userptr` is the audiocache
+bool audiocache_getblock(int16_t *samples, struct blockinfo *info,
+        void *userptr);
+
+
+/*
+ * Writes a cache file from all segments of the source file, in order.
+ * The file is written under a temporary name and only renamed to the
+ * cache file when committed.
+ */
+struct audiocache_writer;
+
+struct audiocache_writer *audiocache_writer_create(const char *dir,
+        const char *infilename, unsigned audiostream,
+        unsigned samplerate, unsigned blocklen);
+void audiocache_writer_add(struct audiocache_writer *w,
+        const struct audiosegment *seg);
+bool audiocache_writer_finish(struct audiocache_writer *w, bool commit);
+
+#endif /* AUDIOCACHE_H_ */
@@ -1,12 +1,11 @@
 #include "dict.h"
 
 #include <stdalign.h>
-#include <ctype.h>
 #include <errno.h>
 
 #include "hashtable.h"
 #include "alloc.h"
-#include "text.h"
+#include "srcdict.h"
 
 
 static hashval_t hashfunc(const char *str)
@@ -16,41 +15,63 @@ static hashval_t hashfunc(const char *str)
     return hash;
 }
 
-static bool matchword(const void *item, const void *key)
+static inline bool matchword(const struct dictword *word, const char *key)
 {
-    const struct dictword *word = item;
     return strcmp(key, word->string) == 0;
 }
 
-static void *createword(const void *key, void *userptr)
+MAKE_HASHTABLE(wordtable, struct dictword, char, matchword)
+
+static struct dictword *createword(const char *key, void *userptr)
 {
     size_t len = strlen(key);
     struct dictword *word = var_alloc(sizeof (struct dictword) + len + 1,
             alignof (struct dictword), userptr);
-    *word = (struct dictword){0};
+    *word = (struct dictword){ .hashval = hashfunc(key) };
     memcpy(word->string, key, len + 1);
     return word;
 }
 
-struct createword_copy_arg { struct dict *dict; const struct dict *srcdict; };
-
-static void *createword_copy(const void *key, void *userptr)
+// adds pronunciation to word, unless it already has the same one
+static void addpron(struct dict *dict, struct dictword *word,
+        const char *pronstr, size_t len)
 {
-    struct createword_copy_arg *arg = userptr;
+    for (struct dictpron **pnptr = &word->pronlist;; pnptr = &(*pnptr)->next) {
+        if (!*pnptr) {
+            *pnptr = var_alloc(sizeof (struct dictpron) + len + 1,
+                    alignof (struct dictpron), dict->pronalloc);
+            (*pnptr)->next = NULL;
+            memcpy((*pnptr)->string, pronstr, len);
+            (*pnptr)->string[len] = '\0';
+            break;
+        }
+        if (!strncmp((*pnptr)->string, pronstr, len) &&
+                !(*pnptr)->string[len])
+            break;
+    }
+}
 
-    struct dictword *srcword = dict_lookup(arg->srcdict, key);
-    if (!srcword) return NULL;
+struct createword_copy_arg {
+    struct dict *dict;
+    const struct srcdict *srcdict;
+    const char *str;
+    struct dictword *word;      // created with first pronunciation
+};
 
-    struct dictword *word = createword(key, arg->dict->wordalloc);
+static void addpron_copy(const char *pron, size_t len, void *userptr)
+{
+    struct createword_copy_arg *arg = userptr;
+    if (!arg->word)
+        arg->word = createword(arg->str, arg->dict->wordalloc);
+    addpron(arg->dict, arg->word, pron, len);
+}
 
-    for (struct dictpron *sp = srcword->pronlist, **pp = &word->pronlist;
-            sp; sp = sp->next, pp = &(*pp)->next) {
-        *pp = var_alloc(sizeof (struct dictpron) + strlen(sp->string) + 1,
-                alignof (struct dictpron), arg->dict->pronalloc);
-        (*pp)->next = NULL;
-        strcpy((*pp)->string, sp->string);
-    }
-    return word;
+static struct dictword *createword_copy(const char *key, void *userptr)
+{
+    struct createword_copy_arg *arg = userptr;
+    arg->str = key;
+    srcdict_lookup(arg->srcdict, key, addpron_copy, arg);
+    return arg->word;
 }
 
 struct dict *dict_create(void)
@@ -58,96 +79,39 @@ struct dict *dict_create(void)
     struct dict *dict = xmalloc(sizeof *dict);
     dict->wordalloc = var_allocator_create(4096);
     dict->pronalloc = var_allocator_create(4096);
-    dict->words = hashtable_create(offsetof(struct dictword, hashval));
+    dict->words = wordtable_create();
     return dict;
 }
 
 void dict_delete(struct dict *dict)
 {
-    hashtable_delete(dict->words);
+    wordtable_delete(dict->words);
     var_allocator_delete(dict->wordalloc);
     var_allocator_delete(dict->pronalloc);
+    free(dict);
 }
 
 struct dictword *dict_lookup(const struct dict *dict, const char *str)
 {
-    return hashtable_lookup(dict->words, hashfunc(str), matchword, str);
+    return wordtable_lookup(dict->words, hashfunc(str), str);
 }
 
 
 struct dictword *dict_lookup_or_add(struct dict *dict, const char *str)
 {
-    return hashtable_lookup_or_add(
-            dict->words, hashfunc(str), matchword, str,
-            createword, dict->wordalloc);
+    return wordtable_lookup_or_add(
+            dict->words, hashfunc(str), str, createword, dict->wordalloc);
 }
 
 struct dictword *dict_lookup_or_copy(struct dict *dict, const char *str,
-        const struct dict *srcdict)
-{
-    struct createword_copy_arg arg = { dict, srcdict };
-
-    return hashtable_lookup_or_add(
-            dict->words, hashfunc(str), matchword, str,
-            createword_copy, &arg);
-}
-
-
-
-bool parse_line(char *line, struct dict *dict)
+        const struct srcdict *srcdict)
 {
-    char *tab = strchr(line, '\t');
-    if (!tab || tab == line) return false;
-    *tab = '\0';
-
-    // remove number in parentheses
-    if (tab >= line + 4 && tab[-1] == ')' && isdigit(tab[-2])) {
-        char *p = tab - 3;
-        while (p >= line + 2 && isdigit(*p)) p--;
-        if (*p == '(') *p = '\0';
-    }
-
-    // add to dictionary
-    struct dictword *word = dict_lookup_or_add(dict, line);
+    struct createword_copy_arg arg = { .dict = dict, .srcdict = srcdict };
 
-    // add pronunciation
-    char *pronstr = tab + 1;
-    for (struct dictpron **pnptr = &word->pronlist;; pnptr = &(*pnptr)->next) {
-        if (!*pnptr) {
-            *pnptr = var_alloc(sizeof (struct dictpron) + strlen(pronstr) + 1,
-                    alignof (struct dictpron), dict->pronalloc);
-            (*pnptr)->next = NULL;
-            strcpy((*pnptr)->string, pronstr);
-            break;
-        }
-        if (!strcmp((*pnptr)->string, pronstr))
-            break;
-    }
-    return true;
+    return wordtable_lookup_or_add(
+            dict->words, hashfunc(str), str, createword_copy, &arg);
 }
 
-bool dict_read(struct dict *dict, const char *filename)
-{
-    linereader_t *lr = linereader_open(filename);
-    if (!lr) return false;
-
-    bool success = true;
-    for (char *line; line = linereader_getline(lr), line;) {
-        if (!*line) continue; // empty line
-        if (!parse_line(line, dict)) {
-            error("Parse error while reading dictionary '%s', line %u",
-                    filename, linereader_linenum(lr));
-            success = false;
-            break;
-        }
-    }
-
-    //hashmap_printstats(dict->words);
-
-    success = success && !linereader_error(lr);
-    linereader_close(lr);
-    return success;
-}
 
 static void writeword(void *item, void *userptr)
 {
@@ -164,6 +128,22 @@ static void writeword(void *item, void *userptr)
     }
 }
 
+void dict_print_stats(const struct dict *dict, FILE *file)
+{
+    struct hashtable_stats stats;
+    wordtable_get_stats(dict->words, &stats);
+    hashtable_print_stats(&stats, "dictionary words", file);
+}
+
+bool dict_write_file(const struct dict *dict, FILE *file, const char *name)
+{
+    wordtable_foreach(dict->words, writeword, file, NULL);
+
+    bool err = fflush(file) || ferror(file);
+    if (err) error("Error while writing to '%s'", name);
+    return !err;
+}
+
 bool dict_write(const struct dict *dict, const char *filename)
 {
     FILE *file = fopen(filename, "w");
@@ -172,11 +152,7 @@ bool dict_write(const struct dict *dict, const char *filename)
         return false;
     }
 
-    hashtable_foreach(dict->words, writeword, file, NULL);
-
-    bool err = ferror(file);
-    if (err) error("Error while writing to '%s'", filename);
-
+    bool success = dict_write_file(dict, file, filename);
     fclose(file);
-    return !err;
+    return success;
 }
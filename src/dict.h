@@ -3,8 +3,10 @@
 
 #include "common.h"
 
+struct srcdict;
+
 struct dict {
-    struct hashtable *words;
+    struct wordtable *words;
     struct var_allocator *wordalloc;
     struct var_allocator *pronalloc;
 };
@@ -12,6 +14,9 @@ struct dict {
 struct dictword {
     hashval_t hashval;
     struct swnode *subnodes;
+    struct swoccur *occurs;  // subnodes sorted by time, see swlist_index
+    unsigned noccurs;
+    unsigned maxspan;        // longest time range of an occurrence
     struct dictpron *pronlist;
     char string[];
 };
@@ -27,12 +32,15 @@ void dict_delete(struct dict *dict);
 struct dictword *dict_lookup(const struct dict *dict, const char *str);
 struct dictword *dict_lookup_or_add(struct dict *dict, const char *str);
 
+// copies word with its pronunciations from source dictionary if not in dict
 struct dictword *dict_lookup_or_copy(struct dict *dict, const char *str,
-        const struct dict *srcdict);
-
-bool dict_read(struct dict *dict, const char *filename);
+        const struct srcdict *srcdict);
 
 bool dict_write(const struct dict *dict, const char *filename);
+// `name` is used in error messages
+bool dict_write_file(const struct dict *dict, FILE *file, const char *name);
+
+void dict_print_stats(const struct dict *dict, FILE *file);
 
 
 #endif /* DICT_H_ */
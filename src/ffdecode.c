@@ -124,6 +124,14 @@ struct ffdec {
 
     unsigned streamindex;
     unsigned decfails;
+    unsigned samplerate;
+
+    // output sample position of the next sample returned by swr_convert
+    uint64_t pos;
+    bool pos_known;
+
+    // selected range in output samples, endpos 0 for end of stream
+    uint64_t startpos, endpos;
 };
 
 
@@ -131,7 +139,7 @@ ffdec_t *ffdec_open(const char *filename,
         unsigned audiostream, unsigned samplerate)
 {
     ffdec_t *ff = xmalloc(sizeof *ff);
-    *ff = (ffdec_t){0};
+    *ff = (ffdec_t){ .samplerate = samplerate };
     av_init_packet(&ff->pkt);
 
     ff->frame = avcodec_alloc_frame();
@@ -159,6 +167,52 @@ fail:
     return NULL;
 }
 
+bool ffdec_seek_range(ffdec_t *ff, timestamp_t start, timestamp_t end)
+{
+    assert(!end || end > start);
+    ff->startpos = (uint64_t)start * ff->samplerate / 1000;
+    ff->endpos = end ? (uint64_t)end * ff->samplerate / 1000 : 0;
+    ff->pos = ff->startpos;
+    if (start == 0) return true;
+
+    // seek to the last key frame before start, samples in between are
+    // decoded and discarded by ffdec_read
+    const AVStream *st = ff->fc->streams[ff->streamindex];
+    int64_t ts = av_rescale_q(start, (AVRational){ 1, 1000 }, st->time_base);
+    if (st->start_time != AV_NOPTS_VALUE) ts += st->start_time;
+
+    int rv = av_seek_frame(ff->fc, ff->streamindex, ts, AVSEEK_FLAG_BACKWARD);
+    if (rv < 0) {
+        error("Could not seek in input file: %s", av_err2str(rv));
+        return false;
+    }
+    avcodec_flush_buffers(ff->cc);
+    return true;
+}
+
+void ffdec_set_end(ffdec_t *ff, timestamp_t end)
+{
+    ff->endpos = end ? (uint64_t)end * ff->samplerate / 1000 : 0;
+}
+
+timestamp_t ffdec_duration(const ffdec_t *ff)
+{
+    const AVStream *st = ff->fc->streams[ff->streamindex];
+    if (st->duration != AV_NOPTS_VALUE)
+        return av_rescale_q(st->duration, st->time_base, (AVRational){ 1, 1000 });
+    else if (ff->fc->duration != AV_NOPTS_VALUE)
+        return av_rescale(ff->fc->duration, 1000, AV_TIME_BASE);
+    else
+        return 0;
+}
+
+timestamp_t ffdec_tell(const ffdec_t *ff)
+{
+    // samples after the end of the range have been decoded, but discarded
+    uint64_t pos = ff->endpos ? MIN(ff->pos, ff->endpos) : ff->pos;
+    return pos * 1000 / ff->samplerate;
+}
+
 void ffdec_close(ffdec_t *ff)
 {
     if (ff->decfails)
@@ -173,6 +227,20 @@ void ffdec_close(ffdec_t *ff)
 }
 
 
+// sets output position from timestamp of the first decoded frame
+static void set_position(ffdec_t *ff)
+{
+    const AVStream *st = ff->fc->streams[ff->streamindex];
+    int64_t pts = av_frame_get_best_effort_timestamp(ff->frame);
+    if (pts != AV_NOPTS_VALUE) {
+        if (st->start_time != AV_NOPTS_VALUE) pts -= st->start_time;
+        pts = av_rescale_q(pts, st->time_base,
+                (AVRational){ 1, ff->samplerate });
+        ff->pos = MAX(pts, 0);
+    }
+    ff->pos_known = true;
+}
+
 static bool read_frame(ffdec_t *ff)
 {
     for (;;) {
@@ -210,12 +278,15 @@ static bool read_frame(ffdec_t *ff)
             ff->have_pkt = false;
         }
 
-        if (got_frame) return true;
+        if (got_frame) {
+            if (!ff->pos_known) set_position(ff);
+            return true;
+        }
     }
 }
 
 
-unsigned ffdec_read(ffdec_t *ff, int16_t *buf, unsigned buflen)
+static unsigned convert(ffdec_t *ff, int16_t *buf, unsigned buflen)
 {
     unsigned fill = 0;
 
@@ -248,3 +319,33 @@ convfail:
     error("swr_convert failed: %s", av_err2str(rv));
     return fill;
 }
+
+
+unsigned ffdec_read(ffdec_t *ff, int16_t *buf, unsigned buflen)
+{
+    unsigned fill = 0;
+
+    while (fill < buflen && !(ff->endpos && ff->pos >= ff->endpos)) {
+        unsigned n = convert(ff, buf + fill, buflen - fill);
+        if (n == 0) break;
+
+        // position is only known after the first frame has been decoded
+        uint64_t pos = ff->pos;
+        ff->pos += n;
+
+        // discard samples before start of range
+        if (pos < ff->startpos) {
+            unsigned skip = MIN(n, ff->startpos - pos);
+            memmove(buf + fill, buf + fill + skip, (n - skip) * sizeof *buf);
+            n -= skip;
+        }
+
+        // discard samples after end of range
+        if (ff->endpos && ff->pos > ff->endpos)
+            n -= MIN(n, ff->pos - ff->endpos);
+
+        fill += n;
+    }
+
+    return fill;
+}
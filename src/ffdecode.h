@@ -14,6 +14,24 @@ ffdec_t *ffdec_open(const char *filename,
 
 void ffdec_close(ffdec_t *ff);
 
+/*
+ * Restricts decoding to the time range [start, end), in ms. `end` 0 decodes
+ * until end of stream. Must be called before the first ffdec_read.
+ */
+bool ffdec_seek_range(ffdec_t *ff, timestamp_t start, timestamp_t end);
+
+// changes the end of the range while reading, see ffdec_seek_range
+void ffdec_set_end(ffdec_t *ff, timestamp_t end);
+
+// duration of selected audio stream in ms, or 0 if unknown
+timestamp_t ffdec_duration(const ffdec_t *ff);
+
+/*
+ * Presentation time of the next sample returned by ffdec_read, in ms. At the
+ * end of the range, this is the end of the range.
+ */
+timestamp_t ffdec_tell(const ffdec_t *ff);
+
 unsigned ffdec_read(ffdec_t *ff, int16_t *buf, unsigned buflen);
 
 #endif /* FFDECODE_H_ */
@@ -0,0 +1,85 @@
+#include "grammar.h"
+
+#include <sphinxbase/fsg_model.h>
+#include "subwords.h"
+#include "dict.h"
+
+#define MAXSKIP 2        // words that can be skipped at once
+#define INSERT_RANGE 2   // insertions from this many words before and after
+
+// transition probabilities of a word state
+#define P_NEXT 0.8
+#define P_SKIP 0.04      // per skip length
+#define P_INSERT 0.04    // for all insertions
+#define P_EXIT 0.04
+
+
+static inline bool in_range(const struct swnode *node,
+        timestamp_t start, timestamp_t end)
+{
+    return node->maxendtime >= start && node->minstarttime <= end;
+}
+
+static int32 logprob(fsg_model_t *fsg, double p)
+{
+    return (int32)(logmath_log(fsg->lmath, p) * fsg->lw);
+}
+
+/*
+ * State i is reached after the first i words. The start and final state
+ * (n + 1 and n + 2) are connected to all word states by null transitions.
+ */
+fsg_model_t *grammar_create(const struct swlist *list,
+        timestamp_t start, timestamp_t end,
+        bool (*known)(const char *word, void *userptr), void *userptr,
+        const char *name, logmath_t *lmath, float lw)
+{
+    const struct dictword **words = NULL;
+    size_t alloc = 0, n = 0;
+    const struct swnode *stop;
+    for (const struct swnode *node = swlist_range(list, start, end, &stop);
+            node != stop; node = node->seq_next) {
+        if (!in_range(node, start, end) || !node->word ||
+                !known(node->word->string, userptr))
+            continue;
+        if (n == alloc)
+            words = grow_array(words, sizeof *words, &alloc, n + 1);
+        words[n++] = node->word;
+    }
+    if (n == 0) return NULL;
+
+    fsg_model_t *fsg = fsg_model_init(name, lmath, lw, n + 3);
+    fsg->start_state = n + 1;
+    fsg->final_state = n + 2;
+
+    int32 *wids = xmalloc(n * sizeof *wids);
+    for (size_t i = 0; i < n; i++)
+        wids[i] = fsg_model_word_add(fsg, words[i]->string);
+
+    for (size_t i = 0; i <= n; i++) {
+        fsg_model_null_trans_add(fsg, fsg->start_state, i,
+                logprob(fsg, 1.0 / (n + 1)));
+        if (i > 0)
+            fsg_model_null_trans_add(fsg, i, fsg->final_state,
+                    logprob(fsg, i < n ? P_EXIT : 1.0));
+
+        // next word, or a later one after skipping some
+        for (size_t k = 0; k <= MAXSKIP && i + k < n; k++)
+            fsg_model_trans_add(fsg, i, i + k + 1,
+                    logprob(fsg, k ? P_SKIP : P_NEXT), wids[i + k]);
+
+        // insertion of a neighbouring word, e.g. a repetition
+        size_t first = i > INSERT_RANGE ? i - INSERT_RANGE : 0;
+        size_t last = MIN(i + INSERT_RANGE, n);
+        for (size_t j = first; j < last; j++)
+            fsg_model_trans_add(fsg, i, i,
+                    logprob(fsg, P_INSERT / (last - first)), wids[j]);
+    }
+
+    // the decoder needs the transitive closure of null transitions
+    glist_free(fsg_model_null_trans_closure(fsg, NULL));
+
+    free(wids);
+    free(words);
+    return fsg;
+}
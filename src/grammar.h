@@ -0,0 +1,24 @@
+#ifndef GRAMMAR_H_
+#define GRAMMAR_H_
+
+#include "common.h"
+
+struct swlist;
+struct fsg_model_s;
+struct logmath_s;
+
+/*
+ * Finite-state grammar of the subtitle word sequence with times overlapping
+ * [start, end], for forced alignment of one segment. The segment can start
+ * and end at any word; words can be skipped, inserted (from the
+ * neighbouring words) and the decoder's filler words are allowed between
+ * all words. Words that are not in the dictionary, and those for which
+ * `known` returns false (missing in the decoder), are left out. Returns
+ * NULL if no words remain. The list must be indexed, see swlist_index.
+ */
+struct fsg_model_s *grammar_create(const struct swlist *list,
+        timestamp_t start, timestamp_t end,
+        bool (*known)(const char *word, void *userptr), void *userptr,
+        const char *name, struct logmath_s *lmath, float lw);
+
+#endif /* GRAMMAR_H_ */
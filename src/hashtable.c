@@ -1,96 +1,87 @@
 #include "hashtable.h"
 
+#define MIN_GROUPS 16
 
 
 
-static void resize(hashtable_t *ht, size_t newsize)
+static void alloc_table(struct hashtable *ht, size_t ngroups)
 {
-    assert(newsize >= ht->count);
-
-    void **newtable = xmalloc(newsize * sizeof *newtable);
-    for (size_t i = 0; i < newsize; i++)
-        newtable[i] = NULL;
-
-    for (size_t i = 0; i < ht->tablesize; i++) {
-        if (!ht->table[i]) continue;
-        hashval_t h = *(hashval_t*)((char*)ht->table[i] + ht->hashval_offset);
-
-        size_t j = h & (newsize - 1);
-        while (newtable[j])
-            j = (j + 1) & (newsize - 1);
+    size_t nslots = ngroups * HT_GROUP;
+    ht->ctrl = xmalloc(nslots);
+    ht->hashes = xmalloc(nslots * sizeof *ht->hashes);
+    ht->items = xmalloc(nslots * sizeof *ht->items);
+    ht->ngroups = ngroups;
+    memset(ht->ctrl, HT_EMPTY, nslots);
+}
 
-        newtable[j] = ht->table[i];
+// stores item in the first empty slot of its probe sequence
+static void place(struct hashtable *ht, hashval_t hashval, void *item)
+{
+    hashval_t mixed = hashtable_mix(hashval);
+    size_t mask = ht->ngroups - 1;
+    for (size_t g = (mixed >> 7) & mask;; g = (g + 1) & mask) {
+        unsigned m = hashtable_group_match(ht->ctrl + g * HT_GROUP, HT_EMPTY);
+        if (m) {
+            size_t i = g * HT_GROUP + __builtin_ctz(m);
+            ht->ctrl[i] = hashtable_fingerprint(mixed);
+            ht->hashes[i] = hashval;
+            ht->items[i] = item;
+            return;
+        }
     }
-
-    free(ht->table);
-    ht->table = newtable;
-    ht->tablesize = newsize;
 }
 
-
-hashtable_t *hashtable_create(size_t hashval_offset)
+static void resize(struct hashtable *ht, size_t ngroups)
 {
-    hashtable_t *ht = xmalloc(sizeof *ht);
-    *ht = (hashtable_t){ .hashval_offset = hashval_offset };
-    resize(ht, 256);
-    return ht;
-}
+    struct hashtable old = *ht;
+    alloc_table(ht, ngroups);
 
+    for (size_t i = 0; i < old.ngroups * HT_GROUP; i++)
+        if (old.ctrl[i] != HT_EMPTY)
+            place(ht, old.hashes[i], old.items[i]);
 
-void hashtable_delete(hashtable_t *ht)
-{
-    free(ht->table);
-    free(ht);
+    hashtable_destroy(&old);
+    ht->nresizes++;
 }
 
 
-static void **lookup_ptr(const hashtable_t *ht, hashval_t hashval,
-        bool (*match)(const void *item, const void *key), const void *key)
+void hashtable_init(struct hashtable *ht)
 {
-    size_t i = hashval & (ht->tablesize - 1);
-    while (ht->table[i]) {
-        if (match(ht->table[i], key)) break;
-        i = (i + 1) & (ht->tablesize - 1);
-    }
-    return &ht->table[i];
+    *ht = (struct hashtable){0};
+    alloc_table(ht, MIN_GROUPS);
 }
 
-void *hashtable_lookup(const hashtable_t *ht, hashval_t hashval,
-        bool (*match)(const void *item, const void *key), const void *key)
+void hashtable_destroy(struct hashtable *ht)
 {
-    return *lookup_ptr(ht, hashval, match, key);
+    free(ht->ctrl);
+    free(ht->hashes);
+    free(ht->items);
 }
 
-void *hashtable_lookup_or_add(hashtable_t *ht, hashval_t hashval,
-        bool (*match)(const void *item, const void *key), const void *key,
-        void *(*create)(const void *key, void *userptr), void *userptr)
+
+void hashtable_insert(struct hashtable *ht, hashval_t hashval, void *item)
 {
-    void **slot = lookup_ptr(ht, hashval, match, key);
-    void *item = *slot;
-    if (!item) {
-        item = create(key, userptr);
-        if (item) {
-            *slot = item;
-            *(hashval_t*)((char*)item + ht->hashval_offset) = hashval;
-            if (++ht->count > ht->tablesize / 2)
-                resize(ht, ht->tablesize * 4);
-        }
-    }
-    return item;
+    // maximum load factor 7/8, an empty slot ends every probe sequence
+    if (ht->count + 1 > ht->ngroups * HT_GROUP / 8 * 7)
+        resize(ht, ht->ngroups * 2);
+
+    place(ht, hashval, item);
+    ht->count++;
 }
 
-size_t hashtable_count(const hashtable_t *ht) { return ht->count; }
 
-void hashtable_foreach(const hashtable_t *ht,
+void hashtable_foreach(const struct hashtable *ht,
         void (*func)(void *item, void *userptr), void *userptr,
         int (*ptr_compar)(const void *, const void *))
 {
+    size_t nslots = ht->ngroups * HT_GROUP;
+
     if (ptr_compar) {
         void **buf = xmalloc(sizeof *buf * ht->count);
         void **p = buf;
-        for (size_t i = 0; i < ht->tablesize; i++)
-            if (ht->table[i])
-                *p++ = ht->table[i];
+        for (size_t i = 0; i < nslots; i++)
+            if (ht->ctrl[i] != HT_EMPTY)
+                *p++ = ht->items[i];
 
         qsort(buf, ht->count, sizeof *buf, ptr_compar);
         for (size_t i = 0; i < ht->count; i++)
@@ -98,9 +89,90 @@ void hashtable_foreach(const hashtable_t *ht,
 
         free(buf);
     } else {
-        for (size_t i = 0; i < ht->tablesize; i++)
-            if (ht->table[i])
-                func(ht->table[i], userptr);
+        for (size_t i = 0; i < nslots; i++)
+            if (ht->ctrl[i] != HT_EMPTY)
+                func(ht->items[i], userptr);
+    }
+}
+
+
+void hashtable_get_stats(const struct hashtable *ht,
+        struct hashtable_stats *stats)
+{
+    size_t nslots = ht->ngroups * HT_GROUP;
+    size_t mask = ht->ngroups - 1;
+    *stats = (struct hashtable_stats) {
+        .ntables = 1,
+        .count = ht->count,
+        .nslots = nslots,
+        .nresizes = ht->nresizes,
+        .bytes = sizeof *ht + nslots * (sizeof *ht->ctrl +
+                sizeof *ht->hashes + sizeof *ht->items)
+    };
+
+    for (size_t i = 0; i < nslots; i++) {
+        if (ht->ctrl[i] == HT_EMPTY) continue;
+
+        size_t group = i / HT_GROUP;
+        size_t home = hashtable_mix(ht->hashes[i]) >> 7;
+        size_t probe = ((group - home) & mask) + 1;
+        stats->probes[MIN(probe, HT_STATS_PROBES) - 1]++;
+        stats->max_probe = MAX(stats->max_probe, probe);
+
+        unsigned m = hashtable_group_match(
+                ht->ctrl + group * HT_GROUP, ht->ctrl[i]);
+        if (m & (m - 1)) stats->fp_collisions++;
+    }
+
+    // clusters can wrap around, start counting after an open group
+    size_t start = 0;
+    while (start < ht->ngroups &&
+            !hashtable_group_match(ht->ctrl + start * HT_GROUP, HT_EMPTY))
+        start++;
+
+    size_t run = 0;
+    for (size_t k = 1; k <= ht->ngroups; k++) {
+        size_t g = (start + k) & mask;
+        if (hashtable_group_match(ht->ctrl + g * HT_GROUP, HT_EMPTY))
+            run = 0;
+        else
+            stats->max_cluster = MAX(stats->max_cluster, ++run);
     }
 }
 
+void hashtable_stats_add(struct hashtable_stats *sum,
+        const struct hashtable_stats *stats)
+{
+    sum->ntables += stats->ntables;
+    sum->count += stats->count;
+    sum->nslots += stats->nslots;
+    for (int i = 0; i < HT_STATS_PROBES; i++)
+        sum->probes[i] += stats->probes[i];
+    sum->max_probe = MAX(sum->max_probe, stats->max_probe);
+    sum->max_cluster = MAX(sum->max_cluster, stats->max_cluster);
+    sum->fp_collisions += stats->fp_collisions;
+    sum->nresizes += stats->nresizes;
+    sum->bytes += stats->bytes;
+}
+
+void hashtable_print_stats(const struct hashtable_stats *stats,
+        const char *name, FILE *file)
+{
+    double mean = 0.0;
+    for (int i = 0; i < HT_STATS_PROBES; i++)
+        mean += (double)(i + 1) * stats->probes[i];
+    if (stats->count) mean /= stats->count;
+
+    fprintf(file, "%s: %zu tables, %zu items, %zu slots, load %.3f, "
+            "%u resizes, %.1f kB\n", name, stats->ntables, stats->count,
+            stats->nslots, stats->nslots ?
+                    (double)stats->count / stats->nslots : 0.0,
+            stats->nresizes, stats->bytes / 1024.0);
+    fprintf(file, "  probe length (groups):");
+    for (int i = 0; i < HT_STATS_PROBES; i++)
+        fprintf(file, " %s%d:%zu", i == HT_STATS_PROBES - 1 ? ">=" : "",
+                i + 1, stats->probes[i]);
+    fprintf(file, "\n  mean probe %.3f, max probe %zu, max cluster %zu groups, "
+            "fingerprint collisions %zu\n", mean, stats->max_probe,
+            stats->max_cluster, stats->fp_collisions);
+}
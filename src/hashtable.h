@@ -3,26 +3,175 @@
 
 #include "common.h"
 
-typedef struct hashtable {
-    void **table;
-    size_t tablesize;            // current table size, power of two
-    size_t count;            // number of items in table
-    size_t hashval_offset;  // offset of hashval within individual items
-} hashtable_t;
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-hashtable_t *hashtable_create(size_t hashval_offset);
-void hashtable_delete(hashtable_t *ht);
+/*
+ * Open addressing hash table of item pointers, without deletion.
+ * Slots are probed in groups of HT_GROUP. A parallel control array holds
+ * a 7 bit fingerprint of the hash value of each slot (or HT_EMPTY), so a
+ * probe compares the fingerprints of a whole group at once and only looks
+ * at items whose fingerprint matches. The full hash values are kept in
+ * another array, for rejecting the rest and for resizing without reading
+ * the items.
+ *
+ * MAKE_HASHTABLE generates a table type for one item and key type, with
+ * the match function inlined into the lookup.
+ */
 
-void *hashtable_lookup(const hashtable_t *ht, hashval_t hashval,
-        bool (*match)(const void *item, const void *key), const void *key);
+#define HT_GROUP 16
+#define HT_EMPTY 0x80
 
-void *hashtable_lookup_or_add(hashtable_t *ht, hashval_t hashval,
-        bool (*match)(const void *item, const void *key), const void *key,
-        void *(*create)(const void *key, void *userptr), void *userptr);
+struct hashtable {
+    uint8_t *ctrl;          // fingerprint of each slot, or HT_EMPTY
+    hashval_t *hashes;      // hash value of each slot
+    void **items;
+    size_t ngroups;         // power of two
+    size_t count;
+    unsigned nresizes;
+};
 
-void hashtable_foreach(const hashtable_t *ht,
+#define HT_STATS_PROBES 8
+
+/*
+ * Table statistics. The probe length of an item is the number of groups
+ * visited to find it, a cluster is a run of groups without empty slot.
+ */
+struct hashtable_stats {
+    size_t ntables;         // > 1 if accumulated
+    size_t count;
+    size_t nslots;
+    size_t probes[HT_STATS_PROBES]; // items with probe length i + 1, last
+                                    // entry counts longer ones too
+    size_t max_probe;
+    size_t max_cluster;
+    size_t fp_collisions;   // items sharing fingerprint with another in group
+    unsigned nresizes;
+    size_t bytes;
+};
+
+void hashtable_init(struct hashtable *ht);
+void hashtable_destroy(struct hashtable *ht);
+
+// adds item that is not in the table yet
+void hashtable_insert(struct hashtable *ht, hashval_t hashval, void *item);
+
+void hashtable_foreach(const struct hashtable *ht,
         void (*func)(void *item, void *userptr), void *userptr,
         int (*ptr_compar)(const void *, const void *));
 
+void hashtable_get_stats(const struct hashtable *ht,
+        struct hashtable_stats *stats);
+void hashtable_stats_add(struct hashtable_stats *sum,
+        const struct hashtable_stats *stats);
+void hashtable_print_stats(const struct hashtable_stats *stats,
+        const char *name, FILE *file);
+
+
+// bit mask of the slots in group with control byte `byte`
+static inline unsigned hashtable_group_match(const uint8_t *ctrl, uint8_t byte)
+{
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(byte)));
+#else
+    unsigned mask = 0;
+    for (unsigned i = 0; i < HT_GROUP; i++)
+        mask |= (unsigned)(ctrl[i] == byte) << i;
+    return mask;
+#endif
+}
+
+/*
+ * Hash values are mixed before use, weak hash functions (e.g. for strings
+ * with common prefixes) would otherwise fill runs of neighbouring groups.
+ * The low 7 bits of the mixed value are the fingerprint, the other bits
+ * select the first group to probe.
+ */
+static inline hashval_t hashtable_mix(hashval_t hashval)
+{
+    hashval ^= hashval >> 16;
+    hashval *= 0x45d9f3b;
+    hashval ^= hashval >> 16;
+    return hashval;
+}
+
+static inline uint8_t hashtable_fingerprint(hashval_t mixed)
+{
+    return mixed & 0x7f;
+}
+
+static inline void *hashtable_find(const struct hashtable *ht,
+        hashval_t hashval, bool (*match)(const void *item, const void *key),
+        const void *key)
+{
+    hashval_t mixed = hashtable_mix(hashval);
+    uint8_t fp = hashtable_fingerprint(mixed);
+    size_t mask = ht->ngroups - 1;
+
+    for (size_t g = (mixed >> 7) & mask;; g = (g + 1) & mask) {
+        const uint8_t *ctrl = ht->ctrl + g * HT_GROUP;
+        for (unsigned m = hashtable_group_match(ctrl, fp); m; m &= m - 1) {
+            size_t i = g * HT_GROUP + __builtin_ctz(m);
+            if (ht->hashes[i] == hashval && match(ht->items[i], key))
+                return ht->items[i];
+        }
+        if (hashtable_group_match(ctrl, HT_EMPTY))
+            return NULL;
+    }
+}
+
+
+/*
+ * Defines `struct name` for items of `itemtype`, looked up by `keytype`,
+ * with `bool match(const itemtype *item, const keytype *key)`.
+ */
+#define MAKE_HASHTABLE(name, itemtype, keytype, match) \
+    struct name { struct hashtable ht; }; \
+    \
+    static inline bool name ## _match(const void *item, const void *key) \
+    { return match((const itemtype*)item, (const keytype*)key); } \
+    \
+    static inline struct name *name ## _create(void) \
+    { \
+        struct name *t = xmalloc(sizeof *t); \
+        hashtable_init(&t->ht); \
+        return t; \
+    } \
+    \
+    static inline void name ## _delete(struct name *t) \
+    { \
+        hashtable_destroy(&t->ht); \
+        free(t); \
+    } \
+    \
+    static inline itemtype *name ## _lookup(const struct name *t, \
+            hashval_t hashval, const keytype *key) \
+    { return hashtable_find(&t->ht, hashval, name ## _match, key); } \
+    \
+    static inline itemtype *name ## _lookup_or_add(struct name *t, \
+            hashval_t hashval, const keytype *key, \
+            itemtype *(*create)(const keytype *key, void *userptr), \
+            void *userptr) \
+    { \
+        itemtype *item = name ## _lookup(t, hashval, key); \
+        if (!item && (item = create(key, userptr))) \
+            hashtable_insert(&t->ht, hashval, item); \
+        return item; \
+    } \
+    \
+    static inline size_t name ## _count(const struct name *t) \
+    { return t->ht.count; } \
+    \
+    static inline void name ## _foreach(const struct name *t, \
+            void (*func)(void *item, void *userptr), void *userptr, \
+            int (*ptr_compar)(const void *, const void *)) \
+    { hashtable_foreach(&t->ht, func, userptr, ptr_compar); } \
+    \
+    static inline void name ## _get_stats(const struct name *t, \
+            struct hashtable_stats *stats) \
+    { hashtable_get_stats(&t->ht, stats); }
+
 
 #endif /* HASHTABLE_H_ */
@@ -21,6 +21,8 @@ struct ngram {
     int n;
     hashval_t hashval;
     unsigned count;
+    unsigned rank;                   // position in model order
+    unsigned wordid;                 // rank of unigram of last word
     float prob;                      // computed probability
     float alpha;                     // computed back-off weight
 };
@@ -31,7 +33,7 @@ struct ngramkey {
 };
 
 struct lmbuilder {
-    struct hashtable *ngrams[N];
+    struct ngramtable *ngrams[N];
     struct fixed_allocator *ngramalloc;
     struct ngram *state[N-1];        // last unigram .. (N-1)-gram
     unsigned unisum;                 // sum of counts of all unigrams
@@ -52,18 +54,22 @@ static hashval_t hashfunc(const struct ngramkey *key)
     return h;
 }
 
-static bool match_ngram(const void *item, const void *key)
+static inline bool match_ngram(const struct ngram *ngram,
+        const struct ngramkey *key)
 {
-    const struct ngramkey *ngramkey = key;
-    const struct ngram *ngram = (const struct ngram*)item;
-    return ngramkey->base == ngram->base && ngramkey->word == ngram->word;
+    return key->base == ngram->base && key->word == ngram->word;
 }
 
-static void *create_ngram(const void *key, void *userptr)
+MAKE_HASHTABLE(ngramtable, struct ngram, struct ngramkey, match_ngram)
+
+static struct ngram *create_ngram(const struct ngramkey *key, void *userptr)
 {
-    const struct ngramkey *ngramkey = key;
     struct ngram *ngram = fixed_alloc(userptr);
-    *ngram = (struct ngram) { .base = ngramkey->base, .word = ngramkey->word };
+    *ngram = (struct ngram) {
+        .base = key->base,
+        .word = key->word,
+        .hashval = hashfunc(key)
+    };
     return ngram;
 }
 
@@ -81,7 +87,7 @@ struct lmbuilder *lmbuilder_create(void)
     lmb->unknown_word = dict_lookup_or_add(lmb->dummydict, "<UNK>");
 
     for (int i = 0; i < N; i++)
-        lmb->ngrams[i] = hashtable_create(offsetof(struct ngram, hashval));
+        lmb->ngrams[i] = ngramtable_create();
 
     return lmb;
 }
@@ -89,7 +95,7 @@ struct lmbuilder *lmbuilder_create(void)
 void lmbuilder_delete(struct lmbuilder *lmb)
 {
     for (int i = 0; i < N; i++)
-        hashtable_delete(lmb->ngrams[i]);
+        ngramtable_delete(lmb->ngrams[i]);
     fixed_allocator_delete(lmb->ngramalloc);
     dict_delete(lmb->dummydict);
     free(lmb);
@@ -116,9 +122,8 @@ void lmbuilder_addword(struct lmbuilder *lmb, const struct dictword *word)
                 .base = i > 0 ? oldstate[i - 1] : NULL,
                 .word = word };
 
-        struct ngram *ngram = hashtable_lookup_or_add(
-                lmb->ngrams[i], hashfunc(&key),
-                match_ngram, &key, create_ngram, lmb->ngramalloc);
+        struct ngram *ngram = ngramtable_lookup_or_add(lmb->ngrams[i],
+                hashfunc(&key), &key, create_ngram, lmb->ngramalloc);
 
         if (ngram->count == 0) { // just created
             ngram->n = i + 1;
@@ -147,14 +152,33 @@ void lmbuilder_break(struct lmbuilder *lmb)
 }
 
 
+static inline bool in_range(const struct swnode *node,
+        timestamp_t start, timestamp_t end)
+{
+    return node->maxendtime >= start && node->minstarttime <= end;
+}
+
 void lmbuilder_add_subnodes(struct lmbuilder *lmb, const struct swlist *list)
 {
-    FOREACH(struct swnode, node, list->first, seq_next) {
+    lmbuilder_add_subnodes_range(lmb, list->first, NULL, 0, UINT32_MAX);
+}
+
+unsigned lmbuilder_add_subnodes_range(struct lmbuilder *lmb,
+        const struct swnode *first, const struct swnode *stop,
+        timestamp_t start, timestamp_t end)
+{
+    unsigned count = 0;
+    for (const struct swnode *node = first; node != stop;
+            node = node->seq_next) {
+        if (!in_range(node, start, end)) continue;
+
         lmbuilder_addword(lmb, node->word);
-        if (!node->seq_next ||
+        count++;
+        if (!node->seq_next || !in_range(node->seq_next, start, end) ||
                 node->maxendtime + 200 < node->seq_next->minstarttime)
             lmbuilder_break(lmb);
     }
+    return count;
 }
 
 
@@ -189,11 +213,107 @@ void lmbuilder_compute_model(const struct lmbuilder *lmb, float discount)
 {
     struct compute_prob_arg probarg = { lmb->unisum, 1.0f - discount };
     for (int i = 0; i < N; i++)
-        hashtable_foreach(lmb->ngrams[i], compute_prob, &probarg, NULL);
+        ngramtable_foreach(lmb->ngrams[i], compute_prob, &probarg, NULL);
 
     struct compute_alpha_arg alphaarg = { discount };
     for (int i = 0; i < N - 1; i++)
-        hashtable_foreach(lmb->ngrams[i], compute_alpha, &alphaarg, NULL);
+        ngramtable_foreach(lmb->ngrams[i], compute_alpha, &alphaarg, NULL);
+}
+
+
+/*
+ * N-grams of each order in model order: unigrams sorted by word, higher
+ * n-grams by the rank of their base, then by the rank of their last word.
+ * This is the order of the ARPA and DMP formats, it is produced by two
+ * counting sort passes on integer ranks per order.
+ */
+struct sorted_model {
+    struct ngram **ngrams[N];
+    size_t count[N];
+};
+
+static void collect_ngram(void *item, void *userptr)
+{
+    struct ngram ***p = userptr;
+    *(*p)++ = item;
+}
+
+static int unigram_compar(const void *p1, const void *p2)
+{
+    const struct ngram *ng1 = *(const void *const*)p1;
+    const struct ngram *ng2 = *(const void *const*)p2;
+    return strcmp(ng1->word->string, ng2->word->string);
+}
+
+static inline unsigned sortkey(const struct ngram *ngram, bool bybase)
+{
+    return bybase ? ngram->base->rank : ngram->wordid;
+}
+
+// stable counting sort by word id or base rank, which are < `nkeys`
+static void counting_sort(struct ngram **ngrams, size_t count, size_t nkeys,
+        bool bybase, struct ngram **tmp)
+{
+    size_t *start = xmalloc((nkeys + 1) * sizeof *start);
+    memset(start, 0, (nkeys + 1) * sizeof *start);
+
+    for (size_t j = 0; j < count; j++)
+        start[sortkey(ngrams[j], bybase) + 1]++;
+    for (size_t k = 0; k < nkeys; k++)
+        start[k + 1] += start[k];
+
+    for (size_t j = 0; j < count; j++)
+        tmp[start[sortkey(ngrams[j], bybase)]++] = ngrams[j];
+
+    memcpy(ngrams, tmp, count * sizeof *ngrams);
+    free(start);
+}
+
+static struct sorted_model sort_model(const struct lmbuilder *lmb)
+{
+    struct sorted_model sm;
+    for (int i = 0; i < N; i++) {
+        sm.count[i] = ngramtable_count(lmb->ngrams[i]);
+        sm.ngrams[i] = xmalloc((sm.count[i] + 1) * sizeof *sm.ngrams[i]);
+        struct ngram **p = sm.ngrams[i];
+        ngramtable_foreach(lmb->ngrams[i], collect_ngram, &p, NULL);
+    }
+
+    // unigram ranks are the word ids
+    qsort(sm.ngrams[0], sm.count[0], sizeof *sm.ngrams[0], unigram_compar);
+    for (size_t j = 0; j < sm.count[0]; j++)
+        sm.ngrams[0][j]->rank = sm.ngrams[0][j]->wordid = j;
+
+    size_t maxcount = 0;
+    for (int i = 1; i < N; i++) maxcount = MAX(maxcount, sm.count[i]);
+    struct ngram **tmp = xmalloc((maxcount + 1) * sizeof *tmp);
+
+    for (int i = 1; i < N; i++) {
+        struct ngram **ngrams = sm.ngrams[i];
+        size_t count = sm.count[i];
+
+        for (size_t j = 0; j < count; j++) {
+            struct ngramkey key = { .word = ngrams[j]->word };
+            ngrams[j]->wordid = ngramtable_lookup(
+                    lmb->ngrams[0], hashfunc(&key), &key)->rank;
+        }
+
+        // least significant key first, the second pass is stable
+        counting_sort(ngrams, count, sm.count[0], false, tmp);
+        counting_sort(ngrams, count, sm.count[i - 1], true, tmp);
+
+        for (size_t j = 0; j < count; j++)
+            ngrams[j]->rank = j;
+    }
+
+    free(tmp);
+    return sm;
+}
+
+static void free_sorted_model(struct sorted_model *sm)
+{
+    for (int i = 0; i < N; i++)
+        free(sm->ngrams[i]);
 }
 
 
@@ -206,11 +326,8 @@ static void print_ngram_words(const struct ngram *ngram, FILE *file)
     fputs(ngram->word->string, file);
 }
 
-static void write_ngram(void *item, void *userptr)
+static void write_ngram(const struct ngram *ngram, FILE *file)
 {
-    struct ngram *ngram = item;
-    FILE *file = userptr;
-
     fprintf(file, "%.4f ", log10f(ngram->prob));
     print_ngram_words(ngram, file);
 
@@ -220,20 +337,6 @@ static void write_ngram(void *item, void *userptr)
     fputs("\n", file);
 }
 
-static int ngram_compar(const void *p1, const void *p2)
-{
-    const struct ngram *ng1 = *(const void *const*)p1;
-    const struct ngram *ng2 = *(const void *const*)p2;
-
-    if (ng1->base != ng2->base) {
-        assert(ng1->base && ng2->base); // only compare n-grams with same n
-        const void *b1 = ng1->base, *b2 = ng2->base;
-        int basecomp = ngram_compar(&b1, &b2);
-        if (basecomp) return basecomp;
-    }
-    return strcmp(ng1->word->string, ng2->word->string);
-}
-
 bool lmbuilder_write_model(const struct lmbuilder *lmb, const char *filename)
 {
     FILE *file = fopen(filename, "w");
@@ -242,18 +345,287 @@ bool lmbuilder_write_model(const struct lmbuilder *lmb, const char *filename)
         return false;
     }
 
+    bool success = lmbuilder_write_model_file(lmb, file, filename);
+    fclose(file);
+    return success;
+}
+
+bool lmbuilder_write_model_file(const struct lmbuilder *lmb,
+        FILE *file, const char *name)
+{
+    struct sorted_model sm = sort_model(lmb);
+
     fputs("\\data\\\n", file);
     for (int i = 0; i < N; i++)
-        fprintf(file, "ngram %d=%u\n", i + 1, lmb->ngrams[i]->count);
+        fprintf(file, "ngram %d=%zu\n", i + 1, sm.count[i]);
 
     for (int i = 0; i < N; i++) {
         fprintf(file, "\n\\%d-grams:\n", i + 1);
-        hashtable_foreach(lmb->ngrams[i], write_ngram, file, ngram_compar);
+        for (size_t j = 0; j < sm.count[i]; j++)
+            write_ngram(sm.ngrams[i][j], file);
     }
     fputs("\n\\end\\\n", file);
+    free_sorted_model(&sm);
 
-    bool err = ferror(file);
-    fclose(file);
-    if (err) error("Error while writing to '%s'", filename);
+    bool err = fflush(file) || ferror(file);
+    if (err) error("Error while writing to '%s'", name);
     return !err;
 }
+
+
+
+/*
+ * Binary trigram model in the sphinx DMP format (version -1, 16 bit
+ * bigram and trigram entries), which pocketsphinx loads without parsing.
+ * Probabilities and back-off weights are log10 values, those of bigrams
+ * and trigrams are indices into quantization tables.
+ */
+
+#define DMP_LOG_SEG_SZ 9          // bigrams per trigram segment, log2
+#define DMP_MAX_ENTRIES 65535     // of word ids and quantization tables
+
+static const char dmp_header[] = "Darpa Trigram LM";
+static const char *const dmp_fmtdesc[] = {
+    "BEGIN FILE FORMAT DESCRIPTION",
+    "Generated by vsubalign, see sphinxbase ngram_model_dmp.c",
+    "END FILE FORMAT DESCRIPTION",
+};
+
+struct quant {
+    float *values;        // sorted
+    size_t count;
+};
+
+static float dmp_log10(float p) { return MAX(log10f(p), -99.0f); }
+
+static int float_compar(const void *p1, const void *p2)
+{
+    float f1 = *(const float*)p1, f2 = *(const float*)p2;
+    return (f1 > f2) - (f1 < f2);
+}
+
+// distinct values rounded to 1e-4 (the ARPA precision) or coarser if needed
+static struct quant quant_build(const float *values, size_t count)
+{
+    struct quant q = { xmalloc((count + 1) * sizeof *q.values), 0 };
+    for (float step = 1e-4f;; step *= 2) {
+        for (size_t j = 0; j < count; j++)
+            q.values[j] = roundf(values[j] / step) * step;
+        qsort(q.values, count, sizeof *q.values, float_compar);
+
+        q.count = 0;
+        for (size_t j = 0; j < count; j++)
+            if (q.count == 0 || q.values[j] != q.values[q.count - 1])
+                q.values[q.count++] = q.values[j];
+        if (q.count <= DMP_MAX_ENTRIES) break;
+    }
+    if (q.count == 0) q.values[q.count++] = 0.0f;
+    return q;
+}
+
+static uint16_t quant_index(const struct quant *q, float value)
+{
+    // nearest entry
+    size_t lo = 0, hi = q->count - 1;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (q->values[mid] < value) lo = mid + 1; else hi = mid;
+    }
+    if (lo > 0 && value - q->values[lo - 1] < q->values[lo] - value) lo--;
+    return lo;
+}
+
+static void write_int32(FILE *file, int32_t value)
+{
+    fwrite(&value, sizeof value, 1, file);
+}
+
+static void write_string(FILE *file, const char *str)
+{
+    write_int32(file, strlen(str) + 1);
+    fwrite(str, 1, strlen(str) + 1, file);
+}
+
+static void write_quant(FILE *file, const struct quant *q)
+{
+    write_int32(file, q->count);
+    fwrite(q->values, sizeof *q->values, q->count, file);
+}
+
+// index of first trigram of each bigram, plus end
+static size_t *first_trigrams(const struct sorted_model *sm)
+{
+    size_t nbigrams = sm->count[1];
+    size_t *first = xmalloc((nbigrams + 1) * sizeof *first);
+    memset(first, 0, (nbigrams + 1) * sizeof *first);
+    for (size_t j = 0; j < sm->count[2]; j++)
+        first[sm->ngrams[2][j]->base->rank + 1]++;
+    for (size_t b = 0; b < nbigrams; b++)
+        first[b + 1] += first[b];
+    return first;
+}
+
+static bool write_dmp(const struct sorted_model *sm, FILE *file,
+        const char *name)
+{
+    size_t nuni = sm->count[0], nbi = sm->count[1], ntri = sm->count[2];
+    if (nuni > DMP_MAX_ENTRIES) {
+        error("Too many words for binary language model '%s'", name);
+        return false;
+    }
+
+    size_t *firsttri = first_trigrams(sm);
+    // the last segment starts past the end if nbi + 1 is a multiple of the
+    // segment size, it has no bigrams then
+    size_t nsegs = (nbi + 1) / (1 << DMP_LOG_SEG_SZ) + 1;
+    int32_t *tseg_base = xmalloc(nsegs * sizeof *tseg_base);
+    for (size_t s = 0; s < nsegs; s++)
+        tseg_base[s] = firsttri[MIN(s << DMP_LOG_SEG_SZ, nbi)];
+
+    for (size_t b = 0; b <= nbi; b++) {
+        if (firsttri[b] - tseg_base[b >> DMP_LOG_SEG_SZ] > DMP_MAX_ENTRIES) {
+            error("Too many trigrams for binary language model '%s'", name);
+            free(firsttri);
+            free(tseg_base);
+            return false;
+        }
+    }
+
+    // quantization tables
+    float *values = xmalloc((MAX(nbi, ntri) + 1) * sizeof *values);
+    for (size_t j = 0; j < nbi; j++)
+        values[j] = dmp_log10(sm->ngrams[1][j]->prob);
+    struct quant prob2 = quant_build(values, nbi);
+    for (size_t j = 0; j < nbi; j++)
+        values[j] = dmp_log10(sm->ngrams[1][j]->alpha);
+    struct quant bo_wt2 = quant_build(values, nbi);
+    for (size_t j = 0; j < ntri; j++)
+        values[j] = dmp_log10(sm->ngrams[2][j]->prob);
+    struct quant prob3 = quant_build(values, ntri);
+    free(values);
+
+    // header
+    write_string(file, dmp_header);
+    write_string(file, name);
+    write_int32(file, -1);              // version
+    write_int32(file, 0);               // timestamp
+    for (size_t j = 0; j < sizeof dmp_fmtdesc / sizeof *dmp_fmtdesc; j++)
+        write_string(file, dmp_fmtdesc[j]);
+    long pos = ftell(file);
+    if (pos >= 0 && pos % 4) {          // align tables to 32 bit
+        write_int32(file, 4 - pos % 4);
+        fwrite("!!!!", 1, 4 - pos % 4, file);
+    }
+    write_int32(file, 0);
+
+    write_int32(file, nuni);
+    write_int32(file, nbi);
+    write_int32(file, ntri);
+
+    // unigrams, with end marker; bigrams of each word start at its first
+    size_t bigram = 0;
+    for (size_t j = 0; j <= nuni; j++) {
+        while (j < nuni && bigram < nbi &&
+                sm->ngrams[1][bigram]->base->rank < j)
+            bigram++;
+        const struct ngram *ng = j < nuni ? sm->ngrams[0][j] : NULL;
+        float prob1 = ng ? dmp_log10(ng->prob) : 0.0f;
+        float bo_wt1 = ng ? dmp_log10(ng->alpha) : 0.0f;
+
+        write_int32(file, j);           // mapid, unused
+        fwrite(&prob1, sizeof prob1, 1, file);
+        fwrite(&bo_wt1, sizeof bo_wt1, 1, file);
+        write_int32(file, j < nuni ? bigram : nbi);
+    }
+
+    // bigrams and trigrams, with end marker for bigrams
+    if (nbi > 0) {
+        for (size_t b = 0; b <= nbi; b++) {
+            const struct ngram *ng = b < nbi ? sm->ngrams[1][b] : NULL;
+            uint16_t entry[4] = {
+                ng ? ng->wordid : 0,
+                ng ? quant_index(&prob2, dmp_log10(ng->prob)) : 0,
+                ng ? quant_index(&bo_wt2, dmp_log10(ng->alpha)) : 0,
+                firsttri[b] - tseg_base[b >> DMP_LOG_SEG_SZ]
+            };
+            fwrite(entry, sizeof entry, 1, file);
+        }
+    }
+    for (size_t t = 0; t < ntri; t++) {
+        const struct ngram *ng = sm->ngrams[2][t];
+        uint16_t entry[2] = {
+            ng->wordid, quant_index(&prob3, dmp_log10(ng->prob))
+        };
+        fwrite(entry, sizeof entry, 1, file);
+    }
+
+    // the reader only expects the tables of the n-gram orders present
+    if (nbi > 0)
+        write_quant(file, &prob2);
+    if (ntri > 0) {
+        write_quant(file, &bo_wt2);
+        write_quant(file, &prob3);
+        write_int32(file, nsegs);
+        fwrite(tseg_base, sizeof *tseg_base, nsegs, file);
+    }
+
+    // word strings in id order
+    size_t wordsize = 0;
+    for (size_t j = 0; j < nuni; j++)
+        wordsize += strlen(sm->ngrams[0][j]->word->string) + 1;
+    write_int32(file, wordsize);
+    for (size_t j = 0; j < nuni; j++) {
+        const char *word = sm->ngrams[0][j]->word->string;
+        fwrite(word, 1, strlen(word) + 1, file);
+    }
+
+    free(prob2.values);
+    free(bo_wt2.values);
+    free(prob3.values);
+    free(firsttri);
+    free(tseg_base);
+    return true;
+}
+
+bool lmbuilder_write_dmp_file(const struct lmbuilder *lmb,
+        FILE *file, const char *name)
+{
+    if (N != 3) {
+        error("Binary language model '%s' needs a trigram model", name);
+        return false;
+    }
+
+    struct sorted_model sm = sort_model(lmb);
+    bool success = write_dmp(&sm, file, name);
+    free_sorted_model(&sm);
+
+    bool err = fflush(file) || ferror(file);
+    if (err) error("Error while writing to '%s'", name);
+    return success && !err;
+}
+
+bool lmbuilder_write_dmp(const struct lmbuilder *lmb, const char *filename)
+{
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        error("Could not write to '%s': %s", filename, strerror(errno));
+        return false;
+    }
+
+    bool success = lmbuilder_write_dmp_file(lmb, file, filename);
+    fclose(file);
+    return success;
+}
+
+
+void lmbuilder_print_stats(const struct lmbuilder *lmb, FILE *file)
+{
+    for (int i = 0; i < N; i++) {
+        char name[16];
+        snprintf(name, sizeof name, "%d-grams", i + 1);
+
+        struct hashtable_stats stats;
+        ngramtable_get_stats(lmb->ngrams[i], &stats);
+        hashtable_print_stats(&stats, name, file);
+    }
+}
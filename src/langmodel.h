@@ -5,6 +5,7 @@
 
 struct dictword;
 struct swlist;
+struct swnode;
 
 struct lmbuilder;
 
@@ -16,10 +17,29 @@ void lmbuilder_break(struct lmbuilder *lmb);
 
 void lmbuilder_add_subnodes(struct lmbuilder *lmb, const struct swlist *list);
 
+/*
+ * Adds the subtitle words from `first` up to `stop` (NULL for the end of
+ * the list) with times overlapping [start, end], returns their count.
+ */
+unsigned lmbuilder_add_subnodes_range(struct lmbuilder *lmb,
+        const struct swnode *first, const struct swnode *stop,
+        timestamp_t start, timestamp_t end);
+
 void lmbuilder_compute_model(const struct lmbuilder *lmb, float discount);
 
 bool lmbuilder_write_model(const struct lmbuilder *lmb, const char *filename);
 
+// writes ARPA model to open file, `name` is used in error messages
+bool lmbuilder_write_model_file(const struct lmbuilder *lmb,
+        FILE *file, const char *name);
+
+// binary model in the sphinx DMP format
+bool lmbuilder_write_dmp(const struct lmbuilder *lmb, const char *filename);
+bool lmbuilder_write_dmp_file(const struct lmbuilder *lmb,
+        FILE *file, const char *name);
+
+void lmbuilder_print_stats(const struct lmbuilder *lmb, FILE *file);
+
 
 
 #endif /* LANGMODEL_H_ */
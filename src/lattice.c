@@ -1,103 +1,123 @@
 #include "lattice.h"
 
 #include <ps_lattice.h>
+#include <sphinxbase/logmath.h>
 #include "dict.h"
-#include "alloc.h"
-#include "hashtable.h"
 
+struct nodeinfo {
+    ps_latnode_t *psnode;
+    int startframe;
+    unsigned index;         // iteration order, then position in lattice
+};
 
-static hashval_t nodehash(const ps_latnode_t *psnode)
+static int time_compar(const void *a, const void *b)
 {
-    hashval_t hash = (uintptr_t)psnode;
-    hash += (hash << 3);
-    hash ^= (hash >> 11);
-    hash += (hash << 15);
-    return hash;
+    const struct nodeinfo *x = a, *y = b;
+    if (x->startframe != y->startframe)
+        return x->startframe < y->startframe ? -1 : 1;
+    return x->index < y->index ? -1 : x->index > y->index;
 }
 
-static bool nodematch(const void *item, const void *key)
+static int ptr_compar(const void *a, const void *b)
 {
-    return key == ((const struct latnode*)item)->psnode;
+    uintptr_t x = (uintptr_t)((const struct nodeinfo*)a)->psnode;
+    uintptr_t y = (uintptr_t)((const struct nodeinfo*)b)->psnode;
+    return x < y ? -1 : x > y;
 }
 
-struct createarg {
-    ps_lattice_t *pslattice;
-    unsigned framerate;
-    const struct dict *dict;
-    struct lattice *lattice;
-};
-
-void *nodecreate(const void *key, void *userptr)
+// index of a pocketsphinx node in the lattice, by binary search
+static unsigned node_index(const struct nodeinfo *byptr, unsigned n,
+        ps_latnode_t *psnode)
 {
-    ps_latnode_t *psnode = (ps_latnode_t*)key;
-    const struct createarg *arg = userptr;
-    struct latnode *node = fixed_alloc(arg->lattice->node_alloc);
-    *node = (struct latnode) {
-        .word = dict_lookup(
-                arg->dict, ps_latnode_baseword(arg->pslattice, psnode)),
-        .time = ps_latnode_times(psnode, NULL, NULL) * 1000 / arg->framerate,
-        .psnode = psnode,
-        .next = arg->lattice->nodelist
-    };
-    arg->lattice->nodelist = node;
-    return node;
+    struct nodeinfo key = { .psnode = psnode };
+    const struct nodeinfo *info =
+            bsearch(&key, byptr, n, sizeof *byptr, ptr_compar);
+    CHECK(info);
+    return info->index;
 }
 
 
 struct lattice *lattice_create(
-        struct ps_lattice_s *pslattice, unsigned framerate,
-        const struct dict *dict)
+        struct ps_lattice_s *pslattice, struct logmath_s *lmath,
+        unsigned framerate, timestamp_t starttime, const struct dict *dict)
 {
-    // TODO: nentries
-
     struct lattice *lat = xmalloc(sizeof *lat);
-    *lat = (struct lattice){
-            .node_alloc = fixed_allocator_create(sizeof (struct latnode), 256),
-            .link_alloc = fixed_allocator_create(sizeof (struct latlink), 256)
-    };
-
-    struct hashtable *nodes =
-            hashtable_create(offsetof(struct latnode, hashval));
+    *lat = (struct lattice){0};
 
-    struct createarg createarg = { pslattice, framerate, dict, lat };
+    if (!pslattice) return lat;
 
+    // collect nodes and count links
+    struct nodeinfo *infos = NULL;
+    size_t alloc = 0, n = 0, nlinks = 0;
     for (ps_latnode_iter_t *psnodeit = ps_latnode_iter(pslattice);
             psnodeit; psnodeit = ps_latnode_iter_next(psnodeit))
     {
         ps_latnode_t *psnode = ps_latnode_iter_node(psnodeit);
-        struct latnode *node = hashtable_lookup_or_add(
-                nodes, nodehash(psnode), nodematch, psnode,
-                nodecreate, &createarg);
+        if (n == alloc)
+            infos = grow_array(infos, sizeof *infos, &alloc, n + 1);
+        infos[n] = (struct nodeinfo) {
+            .psnode = psnode,
+            .startframe = ps_latnode_times(psnode, NULL, NULL),
+            .index = n
+        };
+        n++;
+
+        for (ps_latlink_iter_t *pslinkit = ps_latnode_exits(psnode);
+                pslinkit; pslinkit = ps_latlink_iter_next(pslinkit))
+            nlinks++;
+    }
 
-        ps_latlink_iter_t *pslinkit = ps_latnode_exits(psnode);
+    // links lead to nodes starting after the end of their source
+    qsort(infos, n, sizeof *infos, time_compar);
+    for (size_t i = 0; i < n; i++) infos[i].index = i;
 
-        for (; pslinkit; pslinkit = ps_latlink_iter_next(pslinkit)) {
-            ps_latlink_t *pslink = ps_latlink_iter_link(pslinkit);
-            ps_latnode_t *psdest = ps_latlink_nodes(pslink, NULL);
-            // TODO: int32 ascr; ps_latlink_prob(lattice, link, &ascr); ... ogmath_log_to_ln(logmath, ascr)
+    lat->nodes = xmalloc(n * sizeof *lat->nodes);
+    lat->links = xmalloc(nlinks * sizeof *lat->links);
+    lat->nnodes = n;
+
+    for (size_t i = 0; i < n; i++) {
+        lat->nodes[i] = (struct latnode) {
+            .word = dict_lookup(
+                    dict, ps_latnode_baseword(pslattice, infos[i].psnode)),
+            .time = starttime + infos[i].startframe * 1000 / framerate,
+        };
+    }
 
-            struct latnode *dest = hashtable_lookup_or_add(
-                    nodes, nodehash(psdest), nodematch, psdest,
-                    nodecreate, &createarg);
+    struct nodeinfo *byptr = xmalloc(n * sizeof *byptr);
+    memcpy(byptr, infos, n * sizeof *byptr);
+    qsort(byptr, n, sizeof *byptr, ptr_compar);
 
-            struct latlink *link = fixed_alloc(lat->link_alloc);
-            *link = (struct latlink) {
-                .to = dest,
-                .exits_next = node->exits_head
+    for (size_t i = 0; i < n; i++) {
+        struct latnode *node = &lat->nodes[i];
+        node->exits = lat->nlinks;
+
+        for (ps_latlink_iter_t *pslinkit = ps_latnode_exits(infos[i].psnode);
+                pslinkit; pslinkit = ps_latlink_iter_next(pslinkit)) {
+            ps_latlink_t *pslink = ps_latlink_iter_link(pslinkit);
+            unsigned to = node_index(byptr, n, ps_latlink_nodes(pslink, NULL));
+            assert(to > i);
+
+            int32 ascr;
+            int32 prob = ps_latlink_prob(pslattice, pslink, &ascr);
+            lat->links[lat->nlinks++] = (struct latlink) {
+                .to = to,
+                .ascr = logmath_log_to_ln(lmath, ascr),
+                .prob = logmath_log_to_ln(lmath, prob)
             };
-            node->exits_head = link;
-            dest->nentries++;
+            lat->nodes[to].nentries++;
         }
+        node->nexits = lat->nlinks - node->exits;
     }
 
-    hashtable_delete(nodes);
+    free(byptr);
+    free(infos);
     return lat;
 }
 
 
 void lattice_delete(struct lattice *lat)
 {
-    fixed_allocator_delete(lat->node_alloc);
-    fixed_allocator_delete(lat->link_alloc);
+    free(lat->nodes);
+    free(lat->links);
     free(lat);
 }
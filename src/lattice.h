@@ -4,45 +4,43 @@
 #include "common.h"
 
 struct ps_lattice_s;
+struct logmath_s;
 struct dict;
 
+/*
+ * Nodes are sorted by time, which is a topological order: links only lead
+ * to later nodes. The exits of a node are consecutive in the link array.
+ */
 struct latnode {
     struct dictword *word; // can be NULL, e.g. for <sil>
     timestamp_t time;
-    struct latlink *exits_head;
+    unsigned exits;        // index of first exit link
+    unsigned nexits;
     unsigned nentries;
-    struct latnode *next;
-
-    union {
-        struct { // for generation
-            hashval_t hashval;
-            const struct ps_latnode_s *psnode;
-        };
-        struct { // for alignment
-            struct alnode *pathes;
-            unsigned nentries_remain;
-            struct latnode *ready_next;
-        };
-    };
-
 };
 
 struct latlink {
-    struct latnode *to;
-    struct latlink *exits_next;
-    // TODO: audio score
+    unsigned to;           // node index
+    float ascr;            // acoustic score, natural log
+    float prob;            // posterior probability, natural log
 };
 
 struct lattice {
-    struct latnode *nodelist;
-    struct fixed_allocator *node_alloc;
-    struct fixed_allocator *link_alloc;
+    struct latnode *nodes;
+    unsigned nnodes;
+    struct latlink *links;
+    unsigned nlinks;
 };
 
 
+/*
+ * Converts pocketsphinx lattice, node times are offset by `starttime`.
+ * Link posteriors have to be computed already (ps_get_prob).
+ * Creates an empty lattice if `pslattice` is NULL.
+ */
 struct lattice *lattice_create(
-        struct ps_lattice_s *pslattice, unsigned framerate,
-        const struct dict *dict);
+        struct ps_lattice_s *pslattice, struct logmath_s *lmath,
+        unsigned framerate, timestamp_t starttime, const struct dict *dict);
 
 void lattice_delete(struct lattice *lat);
 
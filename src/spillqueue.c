@@ -0,0 +1,260 @@
+#include "spillqueue.h"
+
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "audio.h"
+
+#define SPILLFILE_MAX ((off_t)256 << 20) // size before a new file is started
+
+/*
+ * Temporary file. The producer starts a new one when all segments of the
+ * current file have been popped, or when it is full. The old file is closed
+ * when its last segment has been mapped; the mappings keep its data until
+ * the segments are deleted, then the system frees the disk space.
+ */
+struct spillfile {
+    FILE *file;
+    off_t end;                      // only accessed by producer
+    unsigned nwaiting;              // segments not mapped yet
+    bool retired;                   // no longer the current file
+};
+
+struct entry {
+    struct entry *next;
+    struct audiosegment *seg;       // NULL if spilled to file
+
+    // location of spilled segment, and its block infos
+    struct spillfile *file;
+    off_t offset;
+    size_t size;
+    struct blockinfo *blocks;
+};
+
+struct spillqueue {
+    size_t memlength;
+    size_t nmem;                    // number of waiting segments in memory
+    unsigned pos;
+    bool closed;
+    bool error;                     // a spilled segment could not be mapped
+
+    struct entry *head;
+    struct entry **tail;
+
+    struct spillfile *file;         // current file, NULL if none
+    size_t pagesize;
+
+    pthread_cond_t popwait;
+    pthread_mutex_t mutex;
+};
+
+
+struct spillqueue *spillqueue_create(size_t memlength)
+{
+    struct spillqueue *q = xmalloc(sizeof *q);
+    *q = (struct spillqueue) {
+        .memlength = memlength,
+        .tail = &q->head,
+        .pagesize = sysconf(_SC_PAGESIZE)
+    };
+
+    CHECK(!pthread_mutex_init(&q->mutex, NULL));
+    CHECK(!pthread_cond_init(&q->popwait, NULL));
+    return q;
+}
+
+static void release_file(struct spillfile *f)
+{
+    if (f->nwaiting == 0 && f->retired) {
+        fclose(f->file);
+        free(f);
+    }
+}
+
+void spillqueue_delete(struct spillqueue *q)
+{
+    if (q->file) q->file->retired = true;
+    FOREACH(struct entry, e, q->head, next) {
+        audiosegment_delete(e->seg);
+        if (e->file) {
+            e->file->nwaiting--;
+            release_file(e->file);
+        }
+        free(e->blocks);
+        free(e);
+    }
+
+    if (q->file) release_file(q->file);
+    pthread_cond_destroy(&q->popwait);
+    pthread_mutex_destroy(&q->mutex);
+    free(q);
+}
+
+
+/*
+ * Returns the file for the next spilled segment and counts the segment as
+ * waiting in it, called with mutex held. NULL if no file can be created.
+ */
+static struct spillfile *spill_target(struct spillqueue *q)
+{
+    struct spillfile *f = q->file;
+    bool drained = f && f->nwaiting == 0 && f->end > 0;
+    if (drained || (f && f->end >= SPILLFILE_MAX)) {
+        f->retired = true;
+        release_file(f);
+        q->file = f = NULL;
+    }
+
+    if (!f) {
+        FILE *file = tmpfile();
+        if (!file) {
+            warning("Could not create temporary file: %s", strerror(errno));
+            return NULL;
+        }
+        f = xmalloc(sizeof *f);
+        *f = (struct spillfile){ .file = file };
+        q->file = f;
+    }
+
+    f->nwaiting++;
+    return f;
+}
+
+/*
+ * Writes segment to the file, at a page aligned offset so that it can be
+ * mapped. Returns false on failure, the segment is then kept.
+ */
+static bool spill(struct spillfile *f, struct entry *e, size_t pagesize)
+{
+    struct audiosegment *seg = e->seg;
+    size_t size = sizeof *seg +
+            seg->nblocks * seg->blocklen * sizeof *seg->samples;
+
+    const char *p = (const char*)seg;
+    for (size_t done = 0; done < size;) {
+        ssize_t rv = pwrite(fileno(f->file),
+                p + done, size - done, f->end + done);
+        if (rv < 0) {
+            warning("Could not write temporary file: %s", strerror(errno));
+            return false;
+        }
+        done += rv;
+    }
+
+    e->file = f;
+    e->offset = f->end;
+    e->size = size;
+    e->blocks = seg->blocks;
+    f->end += (size + pagesize - 1) / pagesize * pagesize;
+
+    // release samples, but not the block infos
+    seg->blocks = NULL;
+    audiosegment_delete(seg);
+    e->seg = NULL;
+    return true;
+}
+
+// maps a spilled segment back, called with mutex held
+static struct audiosegment *unspill(struct entry *e)
+{
+    struct audiosegment *seg = mmap(NULL, e->size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE, fileno(e->file->file), e->offset);
+    e->file->nwaiting--;
+    release_file(e->file);
+
+    if (seg == MAP_FAILED) {
+        error("Could not map temporary file: %s", strerror(errno));
+        free(e->blocks);
+        return NULL;
+    }
+
+    // header in file has stale pointer and size
+    seg->mapsize = e->size;
+    seg->blocks = e->blocks;
+    return seg;
+}
+
+
+/*
+ * Segments that are already mapped from a spill file (popped from another
+ * queue) are not spilled again and not counted as in memory: their pages
+ * are backed by that file.
+ */
+bool spillqueue_push(struct spillqueue *q, struct audiosegment *seg)
+{
+    assert(seg);
+    struct entry *e = xmalloc(sizeof *e);
+    *e = (struct entry){ .seg = seg };
+
+    CHECK(!pthread_mutex_lock(&q->mutex));
+    bool closed = q->closed;
+    struct spillfile *f = NULL;
+    if (!closed && !seg->mapsize && q->nmem >= q->memlength)
+        f = spill_target(q);
+    pthread_mutex_unlock(&q->mutex);
+
+    if (closed) { free(e); return false; }
+
+    // the file is written without lock, only the producer writes it
+    bool spilled = f && spill(f, e, q->pagesize);
+
+    CHECK(!pthread_mutex_lock(&q->mutex));
+    if (f && !spilled) f->nwaiting--;
+    if (!spilled && !seg->mapsize) q->nmem++;
+    *q->tail = e;
+    q->tail = &e->next;
+    CHECK(!pthread_cond_signal(&q->popwait));
+    pthread_mutex_unlock(&q->mutex);
+    return true;
+}
+
+/*
+ * If a spilled segment cannot be mapped, the queue is closed and NULL is
+ * returned, spillqueue_error tells this apart from the end of the queue.
+ */
+struct audiosegment *spillqueue_pop(struct spillqueue *q, unsigned *pos)
+{
+    CHECK(!pthread_mutex_lock(&q->mutex));
+
+    while (!q->closed && !q->head)
+        CHECK(!pthread_cond_wait(&q->popwait, &q->mutex));
+
+    struct audiosegment *seg = NULL;
+    struct entry *e = q->head;
+    if (e && !q->error) {
+        q->head = e->next;
+        if (!q->head) q->tail = &q->head;
+        if (e->seg && !e->seg->mapsize) q->nmem--;
+        if (pos) *pos = q->pos;
+        q->pos++;
+
+        seg = e->seg ? e->seg : unspill(e);
+        if (!seg) {
+            q->error = true;
+            q->closed = true;
+            pthread_cond_broadcast(&q->popwait);
+        }
+        free(e);
+    }
+
+    pthread_mutex_unlock(&q->mutex);
+    return seg;
+}
+
+bool spillqueue_error(struct spillqueue *q)
+{
+    CHECK(!pthread_mutex_lock(&q->mutex));
+    bool error = q->error;
+    pthread_mutex_unlock(&q->mutex);
+    return error;
+}
+
+void spillqueue_close(struct spillqueue *q)
+{
+    CHECK(!pthread_mutex_lock(&q->mutex));
+    q->closed = true;
+    pthread_cond_broadcast(&q->popwait);
+    pthread_mutex_unlock(&q->mutex);
+}
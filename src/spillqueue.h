@@ -0,0 +1,28 @@
+#ifndef SPILLQUEUE_H_
+#define SPILLQUEUE_H_
+
+#include "common.h"
+
+struct audiosegment;
+
+/*
+ * Unbounded FIFO queue of audio segments for one producer thread.
+ * The first `memlength` waiting segments are kept in memory, further ones
+ * are written to a temporary file and memory-mapped back when popped.
+ * The space of popped segments is released once they are deleted and all
+ * segments in the same file have been popped.
+ */
+struct spillqueue;
+
+struct spillqueue *spillqueue_create(size_t memlength);
+void spillqueue_delete(struct spillqueue *q);
+
+bool spillqueue_push(struct spillqueue *q, struct audiosegment *seg);
+
+// returns NULL when the queue is closed and empty, or on error
+struct audiosegment *spillqueue_pop(struct spillqueue *q, unsigned *pos);
+bool spillqueue_error(struct spillqueue *q);
+
+void spillqueue_close(struct spillqueue *q);
+
+#endif /* SPILLQUEUE_H_ */
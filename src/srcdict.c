@@ -0,0 +1,311 @@
+#include "srcdict.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "text.h"
+
+#define INDEX_MAGIC "vsubdx02"
+#define INDEX_SUFFIX ".vsidx"
+
+/*
+ * Sidecar index file: header, followed by the hash table. The key of the
+ * dictionary file is its size and modification time.
+ */
+struct indexheader {
+    char magic[8];
+    uint64_t filesize;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t tablesize;     // number of slots, power of two
+};
+
+// hash table slot for one line, open addressing with linear probing
+struct slot {
+    hashval_t hashval;
+    uint32_t offset;        // offset of line in file plus one, 0 if empty
+};
+
+struct srcdict {
+    const char *text;
+    size_t textsize;
+    void *indexmap;         // mapped sidecar file, or NULL
+    size_t indexmapsize;
+    struct slot *slots;     // in mapping or allocated
+    size_t mask;
+};
+
+
+static hashval_t hashfunc(const char *str, size_t len)
+{
+    hashval_t hash = 5381;
+    for (size_t i = 0; i < len; i++) hash = hash * 33 + str[i];
+    return hash;
+}
+
+// length of word before tab, without number in parentheses
+static size_t word_length(const char *line, const char *tab)
+{
+    if (tab >= line + 4 && tab[-1] == ')' && isdigit(tab[-2])) {
+        const char *p = tab - 3;
+        while (p >= line + 2 && isdigit(*p)) p--;
+        if (*p == '(') return p - line;
+    }
+    return tab - line;
+}
+
+// lines end with "\n", "\r\n" or "\r"
+static const char *line_end(const char *line, const char *textend)
+{
+    const char *end = memchr(line, '\n', textend - line);
+    if (!end) end = textend;
+    const char *cr = memchr(line, '\r', end - line);
+    return cr ? cr : end;
+}
+
+static const char *next_line(const char *end, const char *textend)
+{
+    if (end < textend && *end == '\r') end++;
+    if (end < textend && *end == '\n') end++;
+    return end;
+}
+
+// finds end of line and tab, returns false if there is no word before a tab
+static bool split_line(const char *line, const char *textend,
+        const char **tab, const char **end)
+{
+    *end = line_end(line, textend);
+    *tab = memchr(line, '\t', *end - line);
+    return *tab && *tab != line;
+}
+
+
+static size_t skip_bom(const char *text, size_t size)
+{
+    return size >= sizeof utf8_bom &&
+            !memcmp(text, utf8_bom, sizeof utf8_bom) ? sizeof utf8_bom : 0;
+}
+
+static bool build_index(struct srcdict *sd, const char *filename)
+{
+    const char *textend = sd->text + sd->textsize;
+
+    // upper bound, line breaks "\r\n" are counted twice
+    size_t nlines = 1;
+    for (const char *p = sd->text; (p = memchr(p, '\n', textend - p)); p++)
+        nlines++;
+    for (const char *p = sd->text; (p = memchr(p, '\r', textend - p)); p++)
+        nlines++;
+
+    size_t tablesize = 16;
+    while (tablesize < 2 * nlines) tablesize *= 2;
+
+    sd->slots = xmalloc(tablesize * sizeof *sd->slots);
+    memset(sd->slots, 0, tablesize * sizeof *sd->slots);
+    sd->mask = tablesize - 1;
+
+    const char *line = sd->text + skip_bom(sd->text, sd->textsize);
+    for (unsigned linenum = 1; line < textend; linenum++) {
+        const char *tab, *end;
+        bool valid = split_line(line, textend, &tab, &end);
+
+        if (end > line) {
+            if (!valid) {
+                error("Parse error while reading dictionary '%s', line %u",
+                        filename, linenum);
+                free(sd->slots);
+                sd->slots = NULL;
+                return false;
+            }
+
+            hashval_t hashval = hashfunc(line, word_length(line, tab));
+            size_t i = hashval & sd->mask;
+            while (sd->slots[i].offset) i = (i + 1) & sd->mask;
+            sd->slots[i] = (struct slot) {
+                .hashval = hashval,
+                .offset = line - sd->text + 1
+            };
+        }
+
+        line = next_line(end, textend);
+    }
+    return true;
+}
+
+
+static struct indexheader make_header(const struct stat *st, size_t tablesize)
+{
+    struct indexheader header = {
+        .filesize = st->st_size,
+        .mtime_sec = st->st_mtim.tv_sec,
+        .mtime_nsec = st->st_mtim.tv_nsec,
+        .tablesize = tablesize
+    };
+    memcpy(header.magic, INDEX_MAGIC, sizeof header.magic);
+    return header;
+}
+
+/*
+ * A corrupt index must not lead lookups out of the text, or into an endless
+ * probe loop. Built tables are at most half full.
+ */
+static bool check_slots(const struct slot *slots, size_t tablesize,
+        size_t textsize)
+{
+    size_t used = 0;
+    for (size_t i = 0; i < tablesize; i++) {
+        if (!slots[i].offset) continue;
+        if (slots[i].offset > textsize) return false;
+        used++;
+    }
+    return used <= tablesize / 2;
+}
+
+// maps sidecar index if it is up to date and valid
+static bool load_index(struct srcdict *sd, const char *indexname,
+        const struct stat *st)
+{
+    int fd = open(indexname, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat ist;
+    void *map = MAP_FAILED;
+    if (!fstat(fd, &ist) && (size_t)ist.st_size > sizeof (struct indexheader))
+        map = mmap(NULL, ist.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    struct indexheader header;
+    memcpy(&header, map, sizeof header);
+    struct indexheader expected = make_header(st, header.tablesize);
+
+    size_t tablesize = header.tablesize;
+    const struct slot *slots = (struct slot*)((char*)map + sizeof header);
+    if (memcmp(&header, &expected, sizeof header) ||
+            tablesize == 0 || (tablesize & (tablesize - 1)) ||
+            ist.st_size != (off_t)(sizeof header +
+                    tablesize * sizeof (struct slot)) ||
+            !check_slots(slots, tablesize, sd->textsize)) {
+        munmap(map, ist.st_size);
+        return false;
+    }
+
+    sd->indexmap = map;
+    sd->indexmapsize = ist.st_size;
+    sd->slots = (struct slot*)slots;
+    sd->mask = tablesize - 1;
+    return true;
+}
+
+// writes sidecar index, failure is not an error (e.g. read-only directory)
+static void save_index(const struct srcdict *sd, const char *indexname,
+        const struct stat *st)
+{
+    size_t size = strlen(indexname) + 32;
+    char *tmpname = xmalloc(size);
+    snprintf(tmpname, size, "%s.%ld.tmp", indexname, (long)getpid());
+
+    FILE *file = fopen(tmpname, "wb");
+    if (file) {
+        struct indexheader header = make_header(st, sd->mask + 1);
+        fwrite(&header, sizeof header, 1, file);
+        fwrite(sd->slots, sizeof *sd->slots, sd->mask + 1, file);
+
+        bool err = ferror(file);
+        if (fclose(file) || err || rename(tmpname, indexname))
+            unlink(tmpname);
+    }
+    free(tmpname);
+}
+
+
+struct srcdict *srcdict_open(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        error("Could not open '%s': %s", filename, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        error("Could not stat '%s': %s", filename, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    if ((uint64_t)st.st_size >= UINT32_MAX) {
+        error("Dictionary '%s' is too large", filename);
+        close(fd);
+        return NULL;
+    }
+
+    struct srcdict *sd = xmalloc(sizeof *sd);
+    *sd = (struct srcdict) { .text = "", .textsize = st.st_size };
+
+    if (st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            error("Could not map '%s': %s", filename, strerror(errno));
+            close(fd);
+            free(sd);
+            return NULL;
+        }
+        sd->text = map;
+    }
+    close(fd);
+
+    size_t size = strlen(filename) + sizeof INDEX_SUFFIX;
+    char *indexname = xmalloc(size);
+    snprintf(indexname, size, "%s%s", filename, INDEX_SUFFIX);
+
+    if (!load_index(sd, indexname, &st)) {
+        if (build_index(sd, filename))
+            save_index(sd, indexname, &st);
+        else {
+            srcdict_close(sd);
+            sd = NULL;
+        }
+    }
+
+    free(indexname);
+    return sd;
+}
+
+void srcdict_close(struct srcdict *sd)
+{
+    if (sd->indexmap) munmap(sd->indexmap, sd->indexmapsize);
+    else free(sd->slots);
+    if (sd->textsize > 0) munmap((void*)sd->text, sd->textsize);
+    free(sd);
+}
+
+
+unsigned srcdict_lookup(const struct srcdict *sd, const char *str,
+        void (*addpron)(const char *pron, size_t len, void *userptr),
+        void *userptr)
+{
+    size_t len = strlen(str);
+    hashval_t hashval = hashfunc(str, len);
+    const char *textend = sd->text + sd->textsize;
+
+    // lines of the same word are found in file order along the probe sequence
+    unsigned n = 0;
+    for (size_t i = hashval & sd->mask; sd->slots[i].offset;
+            i = (i + 1) & sd->mask) {
+        if (sd->slots[i].hashval != hashval) continue;
+
+        const char *line = sd->text + sd->slots[i].offset - 1;
+        const char *tab, *end;
+        if (!split_line(line, textend, &tab, &end)) continue;
+
+        if (word_length(line, tab) == len && !memcmp(line, str, len)) {
+            addpron(tab + 1, end - tab - 1, userptr);
+            n++;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,25 @@
+#ifndef SRCDICT_H_
+#define SRCDICT_H_
+
+#include "common.h"
+
+/*
+ * Read-only pronunciation dictionary, memory-mapped from its file. Lines
+ * are found through a hash index that is kept in a sidecar file next to
+ * the dictionary (or in memory if that cannot be written) and rebuilt
+ * when the dictionary changes, so lookups only touch the needed lines.
+ */
+struct srcdict;
+
+struct srcdict *srcdict_open(const char *filename);
+void srcdict_close(struct srcdict *sd);
+
+/*
+ * Calls `addpron` for each pronunciation of word `str`, in file order.
+ * Returns the number of pronunciations.
+ */
+unsigned srcdict_lookup(const struct srcdict *sd, const char *str,
+        void (*addpron)(const char *pron, size_t len, void *userptr),
+        void *userptr);
+
+#endif /* SRCDICT_H_ */
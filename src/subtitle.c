@@ -24,22 +24,71 @@ static bool parse_cuetime(const char *line, struct cuetime *time)
 
 
 
-static inline bool is_upper(char c) { return c >= 'A' && c <= 'Z'; }
-static inline bool is_lower(char c) { return c >= 'a' && c <= 'z'; }
-static inline char to_lower(char c) { return is_upper(c) ? c - 'A' + 'a' : c; }
+/*
+ * Tokenizer: one pass over a line of UTF-8 text. Removed are html tags and
+ * bracketed text (for the hearing impaired), and a speaker name, i.e. text
+ * before a colon without lower case letters. Words are letters, and '-' or
+ * '\'' between letters. They are lower-cased into the token buffer.
+ */
+enum charclass { C_OTHER, C_END, C_UPPER, C_LOWER, C_CONNECT, C_OPEN, C_COLON };
+
+static const uint8_t ascii_class[128] = {
+    [0] = C_END,
+    ['A' ... 'Z'] = C_UPPER,
+    ['a' ... 'z'] = C_LOWER,
+    ['-'] = C_CONNECT, ['\''] = C_CONNECT,
+    ['<'] = C_OPEN, ['['] = C_OPEN, ['{'] = C_OPEN, ['('] = C_OPEN,
+    [':'] = C_COLON,
+};
+
+static const char closing_bracket[128] = {
+    ['<'] = '>', ['['] = ']', ['{'] = '}', ['('] = ')'
+};
 
-static void blank_brackets(char *str, char open, char close)
+// class of the char at *p, advances p and sets the lower case of letters
+static inline enum charclass next_char(const char **p, unsigned *lower)
 {
-    for (char *start = NULL, *p = str; *p; p++) {
-        if (*p == open)
-            start = p;
-        else if (*p == close && start)
-            memset(start, ' ', p - start + 1), start = NULL;
+    uint8_t byte = **p;
+    if (byte < 0x80) {
+        ++*p;
+        *lower = byte | 0x20;
+        return ascii_class[byte];
     }
+
+    unsigned cp = utf8_decode_char(p, NULL);
+    if (!unicode_is_letter(cp)) return C_OTHER;
+    *lower = unicode_tolower(cp);
+    return *lower == cp ? C_LOWER : C_UPPER;
+}
+
+/*
+ * End of the bracketed text starting at `open`, or NULL if the bracket is
+ * not closed. Of nested brackets of one kind, only the innermost is closed.
+ */
+static const char *bracket_end(const char *open)
+{
+    char close = closing_bracket[(uint8_t)*open];
+    const char *end = strchr(open + 1, close);
+    if (!end || memchr(open + 1, *open, end - open - 1)) return NULL;
+    return end;
 }
 
+
+struct tokenizer {
+    const struct cuetime *cuetime;
+    struct swlist *wl;
+    struct dict *dict;
+    const struct srcdict *srcdict;
+
+    // words kept while the line can start with a speaker name, separated
+    // by 0, followed by the current word
+    char *buf;
+    size_t bufcap, len, wordstart;
+    bool speaker_possible;
+};
+
 static void process_wordstring(char *str, const struct cuetime *cuetime,
-        struct swlist *wl, struct dict *dict, const struct dict *srcdict)
+        struct swlist *wl, struct dict *dict, const struct srcdict *srcdict)
 {
     for (;;) {
         struct dictword *word = dict_lookup_or_copy(dict, str, srcdict);
@@ -63,61 +112,153 @@ static void process_wordstring(char *str, const struct cuetime *cuetime,
     }
 }
 
+static inline void append_char(struct tokenizer *tk, unsigned cp)
+{
+    if (tk->len + 5 > tk->bufcap)
+        tk->buf = grow_array(tk->buf, 1, &tk->bufcap, tk->len + 5);
+    if (cp < 0x80)
+        tk->buf[tk->len++] = cp;
+    else
+        tk->len += utf8_encode_char(cp, tk->buf + tk->len);
+}
 
-static void process_line(char *line, const struct cuetime *cuetime,
-        struct swlist *wl, struct dict *dict, const struct dict *srcdict)
+// processes the words before the current one
+static void flush_words(struct tokenizer *tk)
 {
-    // remove html tags and brackets with text for hearing impaired
-    blank_brackets(line, '<', '>');
-    blank_brackets(line, '[', ']');
-    blank_brackets(line, '{', '}');
-    blank_brackets(line, '(', ')');
-
-    // remove upper-case text before colon (speaker name)
-    for (char *p = line; *p; p++) {
-        if (*p == ':') { memset(line, ' ', p - line + 1); break; }
-        if (is_lower(*p)) break; // cancel if lower case before colon
+    if (tk->wordstart == 0) return;
+
+    for (size_t pos = 0; pos < tk->wordstart;) {
+        char *word = tk->buf + pos;
+        pos += strlen(word) + 1;
+        process_wordstring(word, tk->cuetime, tk->wl, tk->dict, tk->srcdict);
     }
 
-    // convert to lower case
-    for (char *p = line; *p; p++)
-        *p = to_lower(*p);
+    memmove(tk->buf, tk->buf + tk->wordstart, tk->len - tk->wordstart);
+    tk->len -= tk->wordstart;
+    tk->wordstart = 0;
+}
+
+static void end_word(struct tokenizer *tk)
+{
+    if (tk->len == tk->wordstart) return;
+    append_char(tk, 0);
+    tk->wordstart = tk->len;
+    if (!tk->speaker_possible) flush_words(tk);
+}
+
+static void process_line(struct tokenizer *tk, const char *line)
+{
+    tk->len = tk->wordstart = 0;
+    tk->speaker_possible = true;
+
+    for (const char *p = line;;) {
+        const char *start = p;
+        unsigned lower;
+        switch (next_char(&p, &lower)) {
+        case C_LOWER:
+            if (tk->speaker_possible) {
+                tk->speaker_possible = false;
+                flush_words(tk);
+            }
+            // fall through
+        case C_UPPER:
+            append_char(tk, lower);
+            break;
+
+        case C_CONNECT: {
+            const char *q = p;
+            enum charclass next = next_char(&q, &lower);
+            if (tk->len > tk->wordstart && (next == C_UPPER || next == C_LOWER))
+                append_char(tk, *start);
+            else
+                end_word(tk);
+            break;
+        }
+
+        case C_OPEN: {
+            end_word(tk);
+            const char *end = bracket_end(start);
+            if (end) p = end + 1;
+            break;
+        }
+
+        case C_COLON:
+            end_word(tk);
+            if (tk->speaker_possible) {
+                tk->speaker_possible = false;
+                tk->len = tk->wordstart = 0;
+            }
+            break;
+
+        case C_END:
+            tk->speaker_possible = false;
+            end_word(tk);
+            flush_words(tk);
+            return;
 
-    // remove non-letter chars, except '-' and '\'' in the middle of words
-    for (char *p = line; *p; p++) {
-        if (!is_lower(*p) && !((*p == '-' || *p == '\'')
-                && p > line && is_lower(p[-1]) && is_lower(p[1])))
-            *p = ' ';
+        case C_OTHER:
+            end_word(tk);
+            break;
+        }
     }
+}
+
+/*
+ * Subtitle files are UTF-8 or CP1252. ASCII lines are the same in both, the
+ * first other line decides (unless there is a byte order mark): the file
+ * is read as CP1252 if it is not valid UTF-8.
+ */
+enum encoding { ENC_UNKNOWN, ENC_UTF8, ENC_CP1252 };
+
+struct textconv {
+    enum encoding enc;
+    char *buf;
+    size_t bufcap;
+};
 
-    // split into words
-    for (char *p = line;;) {
-        while (*p == ' ') p++;
-        if (!*p) break;
-        char *end = strchr(p, ' ');
-        if (end) *end = '\0';
-        process_wordstring(p, cuetime, wl, dict, srcdict);
-        if (!end) break;
-        p = end + 1;
+static const char *convert_line(struct textconv *tc, const char *line,
+        const char *filename)
+{
+    if (tc->enc == ENC_UTF8 || !*skip_ascii(line)) return line;
+
+    if (tc->enc == ENC_UNKNOWN) {
+        if (utf8_validate_string(line)) {
+            tc->enc = ENC_UTF8;
+            return line;
+        }
+        warning("\"%s\" is not UTF-8, reading as CP1252", filename);
+        tc->enc = ENC_CP1252;
     }
+
+    cp1252_to_utf8(&tc->buf, &tc->bufcap, line);
+    return tc->buf;
 }
 
 bool subtitle_readwords(const char *filename,
-        struct swlist *wl, struct dict *dict, const struct dict *srcdict)
+        struct swlist *wl, struct dict *dict, const struct srcdict *srcdict)
 {
     linereader_t *lr = linereader_open(filename);
     if (!lr) return false;
 
+    struct cuetime time;
+    struct tokenizer tk = {
+        .cuetime = &time, .wl = wl, .dict = dict, .srcdict = srcdict };
+
+    struct textconv tc = { .enc = ENC_UNKNOWN };
+
     for (char *line; line = linereader_getline(lr), line;) {
-        struct cuetime time;
+        if (linereader_bom_found(lr)) tc.enc = ENC_UTF8;
         if (!parse_cuetime(line, &time)) continue;
 
         while (line = linereader_getline(lr), line && *line)
-            process_line(line, &time, wl, dict, srcdict);
+            process_line(&tk, convert_line(&tc, line, filename));
     }
 
     bool success = !linereader_error(lr);
     linereader_close(lr);
+    swlist_index(wl);
+    free(tk.buf);
+    free(tc.buf);
     return success;
 }
 
@@ -3,10 +3,11 @@
 
 #include "common.h"
 struct dict;
+struct srcdict;
 struct swlist;
 
 bool subtitle_readwords(const char *filename,
-        struct swlist *wl, struct dict *dict, const struct dict *srcdict);
+        struct swlist *wl, struct dict *dict, const struct srcdict *srcdict);
 
 
 /*typedef struct { unsigned start, end; } subtitle_cuetime_t;
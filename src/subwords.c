@@ -4,6 +4,16 @@
 #include "dict.h"
 #include "hashtable.h"
 
+/*
+ * Time bounds of the list before and after a position, in swlist_index
+ * order. Both are monotonic in the position, for binary search.
+ */
+struct swbound {
+    struct swnode *node;
+    unsigned maxend;        // of the nodes up to this one
+    unsigned minstart;      // of this node and the ones after it
+};
+
 
 struct swlist *swlist_create(void)
 {
@@ -16,6 +26,8 @@ struct swlist *swlist_create(void)
 
 void swlist_delete(struct swlist *wl)
 {
+    free(wl->occurs);
+    free(wl->bounds);
     fixed_allocator_delete(wl->alloc);
     free(wl);
 }
@@ -45,3 +57,127 @@ void swlist_append(struct swlist *wl, struct dictword *word,
 }
 
 
+static int occur_compar(const void *a, const void *b)
+{
+    const struct swoccur *x = a, *y = b;
+    if (x->minstarttime != y->minstarttime)
+        return x->minstarttime < y->minstarttime ? -1 : 1;
+    return x->swnode->position < y->swnode->position ? -1 :
+            x->swnode->position > y->swnode->position;
+}
+
+static void index_bounds(struct swlist *wl)
+{
+    free(wl->bounds);
+    wl->bounds = xmalloc(wl->length * sizeof *wl->bounds);
+
+    unsigned maxend = 0;
+    FOREACH(struct swnode, sw, wl->first, seq_next) {
+        maxend = MAX(maxend, sw->maxendtime);
+        wl->bounds[sw->position] = (struct swbound) {
+            .node = sw, .maxend = maxend, .minstart = sw->minstarttime };
+    }
+    for (unsigned i = wl->length; i-- > 1;)
+        wl->bounds[i - 1].minstart = MIN(wl->bounds[i - 1].minstart,
+                wl->bounds[i].minstart);
+}
+
+void swlist_index(struct swlist *wl)
+{
+    index_bounds(wl);
+
+    free(wl->occurs);
+    wl->occurs = xmalloc(wl->length * sizeof *wl->occurs);
+
+    // count occurrences, then give each word its part of the array
+    FOREACH(struct swnode, sw, wl->first, seq_next)
+        if (sw->word) sw->word->occurs = NULL, sw->word->noccurs = 0;
+    FOREACH(struct swnode, sw, wl->first, seq_next)
+        if (sw->word) sw->word->noccurs++;
+
+    struct swoccur *next = wl->occurs;
+    FOREACH(struct swnode, sw, wl->first, seq_next) {
+        struct dictword *word = sw->word;
+        if (!word || word->occurs) continue;
+        word->occurs = next;
+        word->maxspan = 0;
+        next += word->noccurs;
+        word->noccurs = 0;
+    }
+
+    FOREACH(struct swnode, sw, wl->first, seq_next) {
+        struct dictword *word = sw->word;
+        if (!word) continue;
+        word->occurs[word->noccurs++] = (struct swoccur) {
+            .minstarttime = sw->minstarttime,
+            .maxendtime = sw->maxendtime,
+            .swnode = sw
+        };
+        word->maxspan = MAX(word->maxspan,
+                sw->maxendtime - sw->minstarttime);
+    }
+
+    // sorted when the last occurrence of the word in sequence is reached
+    FOREACH(struct swnode, sw, wl->first, seq_next) {
+        struct dictword *word = sw->word;
+        if (word && sw == word->occurs[word->noccurs - 1].swnode)
+            qsort(word->occurs, word->noccurs, sizeof *word->occurs,
+                    occur_compar);
+    }
+}
+
+// first occurrence with minstarttime >= time
+static const struct swoccur *lower_bound(const struct swoccur *occurs,
+        unsigned n, unsigned time)
+{
+    while (n > 0) {
+        unsigned half = n / 2;
+        if (occurs[half].minstarttime < time)
+            occurs += half + 1, n -= half + 1;
+        else
+            n = half;
+    }
+    return occurs;
+}
+
+const struct swoccur *swlist_occurrences(const struct dictword *word,
+        unsigned time, unsigned tolerance, const struct swoccur **end)
+{
+    unsigned margin = tolerance + word->maxspan;
+    unsigned first = time > margin ? time - margin : 0;
+    unsigned last = time < UINT32_MAX - tolerance ?
+            time + tolerance + 1 : UINT32_MAX;
+
+    const struct swoccur *begin = lower_bound(
+            word->occurs, word->noccurs, first);
+    *end = lower_bound(begin, word->noccurs - (begin - word->occurs), last);
+    return begin;
+}
+
+
+const struct swnode *swlist_range(const struct swlist *wl,
+        unsigned start, unsigned end, const struct swnode **stop)
+{
+    // first position with maxend >= start, then first with minstart > end
+    unsigned lo = 0, n = wl->length;
+    while (n > 0) {
+        unsigned half = n / 2;
+        if (wl->bounds[lo + half].maxend < start)
+            lo += half + 1, n -= half + 1;
+        else
+            n = half;
+    }
+
+    unsigned hi = lo;
+    n = wl->length - lo;
+    while (n > 0) {
+        unsigned half = n / 2;
+        if (wl->bounds[hi + half].minstart <= end)
+            hi += half + 1, n -= half + 1;
+        else
+            n = half;
+    }
+
+    *stop = hi < wl->length ? wl->bounds[hi].node : NULL;
+    return lo < wl->length ? wl->bounds[lo].node : NULL;
+}
@@ -19,6 +19,15 @@ struct swlist {
     struct fixed_allocator *alloc;
     struct swnode *first, *last;
     unsigned length;
+    struct swoccur *occurs;  // of all words, see swlist_index
+    struct swbound *bounds;  // per position, see swlist_range
+};
+
+// occurrence of a word, in the sorted array of the word
+struct swoccur {
+    unsigned minstarttime;
+    unsigned maxendtime;
+    struct swnode *swnode;
 };
 
 
@@ -29,5 +38,25 @@ void swlist_delete(struct swlist *wl);
 void swlist_append(struct swlist *wl, struct dictword *word,
         unsigned minstarttime, unsigned maxendtime);
 
+// builds the occurrence arrays of the words, after the last append
+void swlist_index(struct swlist *wl);
+
+/*
+ * Finds the occurrences of `word` whose time range is within `tolerance`
+ * of `time`. Returns the first one and sets `end`, the range can contain
+ * others whose time range ends earlier.
+ */
+const struct swoccur *swlist_occurrences(const struct dictword *word,
+        unsigned time, unsigned tolerance, const struct swoccur **end);
+
+/*
+ * Finds the nodes that can overlap [start, end]: the nodes before the
+ * returned one end before `start`, those from `stop` on (NULL at the end of
+ * the list) start after `end`. The nodes in between are not all in range,
+ * their order in the list need not be their time order.
+ */
+const struct swnode *swlist_range(const struct swlist *wl,
+        unsigned start, unsigned end, const struct swnode **stop);
+
 
 #endif
@@ -1,16 +1,48 @@
 #include "text.h"
 
 #include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 #define REPLACE 0xfffd // replacement char
 
 const uint8_t utf8_bom[3] = { 0xef, 0xbb, 0xbf };
 
+// ASCII other than 0
+static inline bool is_ascii(char c) { return (uint8_t)c - 1u < 0x7f; }
+
+/*
+ * Checks 16 bytes at a time for bytes with the high bit set or 0. Loads are
+ * aligned, so they do not cross into an unmapped page after the string.
+ */
+const char *skip_ascii(const char *s)
+{
+#ifdef __SSE2__
+    for (; (uintptr_t)s % 16; s++)
+        if (!is_ascii(*s)) return s;
+
+    const __m128i zero = _mm_setzero_si128();
+    for (;; s += 16) {
+        __m128i chunk = _mm_load_si128((const __m128i*)s);
+        unsigned mask = _mm_movemask_epi8(chunk) |
+                _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zero));
+        if (mask) return s + __builtin_ctz(mask);
+    }
+#else
+    while (is_ascii(*s)) s++;
+    return s;
+#endif
+}
+
 bool utf8_validate_string(const char *s)
 {
     bool invalid = false;
-    while (*s && !invalid)
+    while (*(s = skip_ascii(s)) && !invalid)
         utf8_decode_char(&s, &invalid);
     return !invalid;
 }
@@ -48,7 +80,7 @@ invalid:
 }
 
 
-static unsigned utf8_encode_char(unsigned cp, char buf[4])
+unsigned utf8_encode_char(unsigned cp, char buf[4])
 {
     if (cp <= 0x7f) {
         buf[0] = cp;
@@ -75,6 +107,75 @@ invalid:
     return utf8_encode_char(REPLACE, buf);
 }
 
+/*
+ * Upper case letters: code points first + k * stride up to last map to
+ * cp + delta. Sorted by first.
+ */
+static const struct caserange {
+    uint16_t first, last;
+    int16_t delta;
+    uint8_t stride;
+} upper_ranges[] = {
+    { 0x0041, 0x005a, 32, 1 },      // Basic Latin
+    { 0x00c0, 0x00d6, 32, 1 },      // Latin-1 Supplement
+    { 0x00d8, 0x00de, 32, 1 },
+    { 0x0100, 0x012e, 1, 2 },       // Latin Extended-A
+    { 0x0130, 0x0130, -199, 1 },
+    { 0x0132, 0x0136, 1, 2 },
+    { 0x0139, 0x0147, 1, 2 },
+    { 0x014a, 0x0176, 1, 2 },
+    { 0x0178, 0x0178, -121, 1 },
+    { 0x0179, 0x017d, 1, 2 },
+    { 0x0386, 0x0386, 38, 1 },      // Greek
+    { 0x0388, 0x038a, 37, 1 },
+    { 0x038c, 0x038c, 64, 1 },
+    { 0x038e, 0x038f, 63, 1 },
+    { 0x0391, 0x03a1, 32, 1 },
+    { 0x03a3, 0x03ab, 32, 1 },
+    { 0x0400, 0x040f, 80, 1 },      // Cyrillic
+    { 0x0410, 0x042f, 32, 1 },
+    { 0x0460, 0x0480, 1, 2 },
+    { 0x048a, 0x04be, 1, 2 },
+    { 0x04c0, 0x04c0, 15, 1 },
+    { 0x04c1, 0x04cd, 1, 2 },
+    { 0x04d0, 0x04fe, 1, 2 },
+    { 0x0500, 0x052e, 1, 2 },
+};
+
+// all letters, including the upper case ones
+static const struct { uint16_t first, last; } letter_ranges[] = {
+    { 0x0041, 0x005a }, { 0x0061, 0x007a },
+    { 0x00aa, 0x00aa }, { 0x00b5, 0x00b5 }, { 0x00ba, 0x00ba },
+    { 0x00c0, 0x00d6 }, { 0x00d8, 0x00f6 }, { 0x00f8, 0x024f },
+    { 0x0386, 0x0386 }, { 0x0388, 0x03ff },
+    { 0x0400, 0x0481 }, { 0x048a, 0x052f },
+};
+
+bool unicode_is_letter(unsigned cp)
+{
+    for (size_t i = 0; i < sizeof letter_ranges / sizeof *letter_ranges; i++)
+        if (cp <= letter_ranges[i].last)
+            return cp >= letter_ranges[i].first;
+    return false;
+}
+
+unsigned unicode_tolower(unsigned cp)
+{
+    if (cp < 0x80)
+        return cp >= 'A' && cp <= 'Z' ? cp + 32 : cp;
+
+    for (size_t i = 0; i < sizeof upper_ranges / sizeof *upper_ranges; i++) {
+        const struct caserange *r = &upper_ranges[i];
+        if (cp <= r->last) {
+            if (cp >= r->first && (cp - r->first) % r->stride == 0)
+                return cp + r->delta;
+            break;
+        }
+    }
+    return cp;
+}
+
+
 void cp1252_to_utf8(char **bufp, size_t *bufcap, const char *src)
 {
     static const uint16_t table[32] = {
@@ -86,8 +187,12 @@ void cp1252_to_utf8(char **bufp, size_t *bufcap, const char *src)
 
     size_t n = 0;
     for (;;) {
-        if (n + 4 > *bufcap)
-            *bufp = grow_array(*bufp, 1, bufcap, n + 3);
+        const char *end = skip_ascii(src);
+        if (n + (end - src) + 4 > *bufcap)
+            *bufp = grow_array(*bufp, 1, bufcap, n + (end - src) + 4);
+        memcpy(*bufp + n, src, end - src);
+        n += end - src;
+        src = end;
 
         uint8_t byte = *(const uint8_t*)src++;
         if (byte < 128)
@@ -102,15 +207,42 @@ void cp1252_to_utf8(char **bufp, size_t *bufcap, const char *src)
 
 
 
+/*
+ * Regular files are memory-mapped and lines are copied into the buffer,
+ * other files (e.g. pipes) are read into the buffer in blocks. Line ends
+ * are found with a vectorized scan for the bytes '\r', '\n' and 0.
+ */
 struct linereader {
-    FILE *file;
+    FILE *file;             // NULL if mapped
+    const char *map;
+    size_t mapsize, mappos;
     char *buffer;
-    size_t bsize, bpos;
+    size_t bsize, bpos;     // for mapped files: bsize is the capacity
     bool done, error, readend;
     unsigned linenum;
     bool bom_found;
 };
 
+// returns the first '\r', '\n' or 0 in [p, end), or end
+static const char *find_special(const char *p, const char *end)
+{
+#ifdef __SSE2__
+    const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        __m128i match = _mm_or_si128(_mm_cmpeq_epi8(chunk, zero),
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, cr),
+                        _mm_cmpeq_epi8(chunk, lf)));
+        unsigned mask = _mm_movemask_epi8(match);
+        if (mask) return p + __builtin_ctz(mask);
+    }
+#endif
+    for (; p < end; p++)
+        if (*p == '\r' || *p == '\n' || *p == 0) break;
+    return p;
+}
+
 linereader_t *linereader_open(const char *filename)
 {
     FILE *file = fopen(filename, "rb");
@@ -121,13 +253,28 @@ linereader_t *linereader_open(const char *filename)
 
     linereader_t *lr = xmalloc(sizeof *lr);
     *lr = (linereader_t){ .file = file };
+
+    struct stat st;
+    if (!fstat(fileno(file), &st) && S_ISREG(st.st_mode) && st.st_size > 0 &&
+            (uint64_t)st.st_size <= SIZE_MAX) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                fileno(file), 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            lr->map = map;
+            lr->mapsize = st.st_size;
+            lr->file = NULL;
+            fclose(file);
+        }
+    }
     return lr;
 }
 
 void linereader_close(linereader_t *lr)
 {
     free(lr->buffer);
-    fclose(lr->file);
+    if (lr->file) fclose(lr->file);
+    if (lr->map) munmap((void*)lr->map, lr->mapsize);
     free(lr);
 }
 
@@ -171,38 +318,75 @@ static bool read_more(linereader_t *lr)
     return n > 0;
 }
 
-
-char *linereader_getline(linereader_t *lr)
+// finds the next line in the stream buffer, sets its start and length
+static bool stream_nextline(linereader_t *lr, char **line, size_t *len)
 {
-    if (lr->done) return NULL;
-
-    char *line;
     size_t n = 0;
-
-    for (;; n++) {
+    for (;;) {
         if (lr->bpos + n >= lr->bsize && !read_more(lr)) {
             lr->done = true;
-            line = lr->buffer + lr->bpos;
             break;
         }
 
-        char c = lr->buffer[lr->bpos + n];
+        const char *start = lr->buffer + lr->bpos;
+        n = find_special(start + n, lr->buffer + lr->bsize) - start;
+        if (lr->bpos + n == lr->bsize) continue;
 
-        if (c == '\r' || c == '\n') {
-            bool windows_linebreak = c == '\r'
-                    && (lr->bpos + n + 1 < lr->bsize || read_more(lr))
-                    && lr->buffer[lr->bpos + n + 1] == '\n';
-            line = lr->buffer + lr->bpos;
-            lr->bpos = lr->bpos + n + (windows_linebreak ? 2 : 1);
-            break;
-        }
+        char c = start[n];
+        if (c == 0) return false;
 
-        if (c == 0) {
-            lr->error = lr->done = true;
-            error("Not a text file or unsupported encoding");
-            return NULL;
-        }
+        bool windows_linebreak = c == '\r'
+                && (lr->bpos + n + 1 < lr->bsize || read_more(lr))
+                && lr->buffer[lr->bpos + n + 1] == '\n';
+        *line = lr->buffer + lr->bpos;
+        *len = n;
+        lr->bpos = lr->bpos + n + (windows_linebreak ? 2 : 1);
+        return true;
+    }
+
+    *line = lr->buffer + lr->bpos;
+    *len = n;
+    return true;
+}
+
+// finds the next line in the mapping and copies it to the buffer
+static bool map_nextline(linereader_t *lr, char **line, size_t *len)
+{
+    const char *start = lr->map + lr->mappos;
+    const char *end = lr->map + lr->mapsize;
+    const char *p = find_special(start, end);
+
+    if (p == end) {
+        lr->done = true;
+        lr->mappos = lr->mapsize;
+    } else if (*p == 0) {
+        return false;
+    } else {
+        bool windows_linebreak = *p == '\r' && p + 1 < end && p[1] == '\n';
+        lr->mappos = p - lr->map + (windows_linebreak ? 2 : 1);
+    }
+
+    size_t n = p - start;
+    if (n + 1 > lr->bsize)
+        lr->buffer = grow_array(lr->buffer, 1, &lr->bsize, n + 1);
+    memcpy(lr->buffer, start, n);
+    *line = lr->buffer;
+    *len = n;
+    return true;
+}
 
+
+char *linereader_getline(linereader_t *lr)
+{
+    if (lr->done) return NULL;
+
+    char *line;
+    size_t n;
+    if (!(lr->map ? map_nextline(lr, &line, &n) :
+            stream_nextline(lr, &line, &n))) {
+        lr->error = lr->done = true;
+        error("Not a text file or unsupported encoding");
+        return NULL;
     }
 
     if (lr->linenum == 0 && n >= 3 && !memcmp(line, utf8_bom, 3))
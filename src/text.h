@@ -5,9 +5,18 @@
 
 extern const uint8_t utf8_bom[3];
 
+// first byte of s that is not ASCII, or the terminating 0
+const char *skip_ascii(const char *s);
+
 unsigned utf8_decode_char(const char **ptr, bool *invalid);
+unsigned utf8_encode_char(unsigned cp, char buf[4]);
 bool utf8_validate_string(const char *s);
 
+// letters of the Latin, Greek and Cyrillic scripts
+bool unicode_is_letter(unsigned cp);
+// lower case of a letter in these scripts, other code points are returned
+unsigned unicode_tolower(unsigned cp);
+
 void cp1252_to_utf8(char **bufp, size_t *bufcap, const char *src);
 
 
@@ -1,134 +1,679 @@
+#define _GNU_SOURCE // memfd_create
 #include "vsubalign.h"
 
 #include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <pocketsphinx.h>
 #include <sphinxbase/err.h>
+#include <sphinxbase/ngram_model.h>
+#include <sphinxbase/ckd_alloc.h>
 
 #include "ffdecode.h"
 #include "audio.h"
+#include "audiocache.h"
 #include "aqueue.h"
+#include "spillqueue.h"
 #include "langmodel.h"
 #include "subtitle.h"
 #include "subwords.h"
 #include "dict.h"
+#include "srcdict.h"
+#include "grammar.h"
+#include "lattice.h"
+#include "alignment.h"
 
 #define SAMPLERATE 16000
 #define BLOCKLEN (SAMPLERATE / 20)
 #define SEGMENTMIN (10 * SAMPLERATE / BLOCKLEN)
 #define SEGMENTMAX (30 * SAMPLERATE / BLOCKLEN)
+#define DECODERANGE_MIN (2 * 60 * 1000) // minimum length of decode ranges
+#define SEGMENTS_INMEMORY 8 // waiting segments kept in memory before spilling
+#define PLACEHOLDER_GRAMMAR "placeholder" // initial grammar, only silence
 
 
 
-static struct audioblock *getblock(void *userptr)
+static bool getblock(int16_t *samples, struct blockinfo *info, void *userptr)
 {
     struct ffdec *ff = userptr;
-    struct audioblock *ab = xmalloc(
-            sizeof *ab + BLOCKLEN * sizeof *ab->samples);
+    unsigned read = ffdec_read(ff, samples, BLOCKLEN);
 
-    unsigned read = ffdec_read(ff, ab->samples, BLOCKLEN);
-
-    if (read == 0) { free(ab); return NULL; }
+    if (read == 0) return false;
 
     for (unsigned i = read; i < BLOCKLEN; i++)
-        ab->samples[i] = 0;
-
-    return ab;
+        samples[i] = 0;
 
-    // TODO: time
+    info->starttime = ffdec_tell(ff) - read * 1000 / SAMPLERATE;
+    return true;
 }
 
 
-static void deletesegment(void *ptr)
+/*
+ * Splits audio into segments and pushes them to queue, and writes them to
+ * the cache if `cw` is given. Returns false if the consumer stopped early.
+ */
+static bool split_segments(
+        bool (*getblock)(int16_t*, struct blockinfo*, void*), void *userptr,
+        struct spillqueue *segments, float silence_low, float silence_high,
+        struct audiocache_writer *cw)
 {
-    FOREACH(struct audioblock, block, ptr, next)
-        free(block);
+    struct audiosplitter *sp = audiosplitter_create(
+            BLOCKLEN, SEGMENTMIN, SEGMENTMAX, getblock, userptr);
+    audiosplitter_set_silence(sp, silence_low, silence_high);
+
+    bool complete = true;
+    struct audiosegment *seg;
+    while ((seg = audiosplitter_next_segment(sp))) {
+        if (cw) audiocache_writer_add(cw, seg);
+        if (!spillqueue_push(segments, seg)) {
+            audiosegment_delete(seg);
+            complete = false;
+            break;
+        }
+    }
+
+    audiosplitter_delete(sp);
+    return complete;
 }
 
+
 struct decode_arg
 {
     const char *infilename;
     unsigned audiostream;
-    struct aqueue *segments;
+    unsigned n_threads;
+    float silence_low, silence_high;
+    const char *cache_dir;
+    struct spillqueue *segments;
     bool success;
 };
 
+
+/*
+ * Ranges are not cut at their nominal start times, which would split words.
+ * Each range but the first drops its first segment, and the previous range
+ * continues to the split point at its end, which lies in a silence if
+ * there is one. Only this short stretch is decoded twice.
+ */
+struct decoderange_arg
+{
+    pthread_t thread;
+    struct ffdec *ff;
+    struct spillqueue *segments;
+    float silence_low, silence_high;
+
+    timestamp_t start;              // nominal start
+    struct decoderange_arg *prev, *next;
+    bool end_set;                   // end of range set to next->splitpoint
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool splitpoint_known;
+    timestamp_t splitpoint;         // end of first segment, 0 for none
+};
+
+static void set_splitpoint(struct decoderange_arg *arg, timestamp_t time)
+{
+    CHECK(!pthread_mutex_lock(&arg->mutex));
+    arg->splitpoint = time;
+    arg->splitpoint_known = true;
+    pthread_cond_signal(&arg->cond);
+    pthread_mutex_unlock(&arg->mutex);
+}
+
+static timestamp_t wait_splitpoint(struct decoderange_arg *arg)
+{
+    CHECK(!pthread_mutex_lock(&arg->mutex));
+    while (!arg->splitpoint_known)
+        pthread_cond_wait(&arg->cond, &arg->mutex);
+    timestamp_t time = arg->splitpoint;
+    pthread_mutex_unlock(&arg->mutex);
+    return time;
+}
+
+static bool range_getblock(int16_t *samples, struct blockinfo *info,
+        void *userptr)
+{
+    struct decoderange_arg *arg = userptr;
+    if (arg->next && !arg->end_set &&
+            ffdec_tell(arg->ff) >= arg->next->start) {
+        ffdec_set_end(arg->ff, wait_splitpoint(arg->next));
+        arg->end_set = true;
+    }
+    return getblock(samples, info, arg->ff);
+}
+
+/*
+ * Range decoding thread.
+ * Decodes one time range of the source file into its own segment queue.
+ */
+static void *decode_range(void *ptr)
+{
+    struct decoderange_arg *arg = ptr;
+    struct audiosplitter *sp = audiosplitter_create(
+            BLOCKLEN, SEGMENTMIN, SEGMENTMAX, range_getblock, arg);
+    audiosplitter_set_silence(sp, arg->silence_low, arg->silence_high);
+
+    struct audiosegment *seg = audiosplitter_next_segment(sp);
+    if (arg->prev) {
+        // the previous range decodes up to the end of the first segment
+        set_splitpoint(arg, seg ? seg->blocks[seg->nblocks - 1].starttime +
+                BLOCKLEN * 1000 / SAMPLERATE : 0);
+        audiosegment_delete(seg);
+        seg = audiosplitter_next_segment(sp);
+    }
+
+    for (; seg; seg = audiosplitter_next_segment(sp)) {
+        if (!spillqueue_push(arg->segments, seg)) {
+            audiosegment_delete(seg);
+            break;
+        }
+    }
+
+    audiosplitter_delete(sp);
+    spillqueue_close(arg->segments);
+    return NULL;
+}
+
+
+// opens decoders for `n` consecutive time ranges covering the source file
+static bool open_ranges(struct decoderange_arg *ranges, unsigned n,
+        struct ffdec *ff, timestamp_t duration, const struct decode_arg *arg)
+{
+    for (unsigned i = 0; i < n; i++) {
+        // range starts at full seconds, so that blocks of all ranges start
+        // at multiples of the block length
+        timestamp_t start = (uint64_t)duration * i / n / 1000 * 1000;
+
+        struct ffdec *rff = i == 0 ? ff :
+                ffdec_open(arg->infilename, arg->audiostream, SAMPLERATE);
+        if (!rff) return false;
+
+        ranges[i].ff = rff;
+        ranges[i].segments = spillqueue_create(SEGMENTS_INMEMORY);
+        ranges[i].silence_low = arg->silence_low;
+        ranges[i].silence_high = arg->silence_high;
+        ranges[i].start = start;
+        ranges[i].prev = i > 0 ? &ranges[i - 1] : NULL;
+        ranges[i].next = i + 1 < n ? &ranges[i + 1] : NULL;
+
+        // the end is set when the next range has found its first split point
+        if (!ffdec_seek_range(rff, start, 0)) return false;
+    }
+    return true;
+}
+
+
 /*
  * Audio decoding thread.
  * Reads source file, generates segments and pushes them to queue.
+ * Long files are split into time ranges which are decoded concurrently
+ * by `n_threads` threads, their segments are pushed to the queue in order.
+ * With a cache directory, the decoded audio is read from the cache file
+ * if it is up to date, otherwise the cache file is written.
  */
 void *decode(void *ptr)
 {
     struct decode_arg *arg = ptr;
     arg->success = false;
+    struct audiocache_writer *cw = NULL;
+    bool complete = false;
+
+    if (arg->cache_dir) {
+        struct audiocache *ac = audiocache_open(arg->cache_dir,
+                arg->infilename, arg->audiostream, SAMPLERATE, BLOCKLEN);
+        if (ac) {
+            split_segments(audiocache_getblock, ac, arg->segments,
+                    arg->silence_low, arg->silence_high, NULL);
+            audiocache_close(ac);
+            arg->success = true;
+            goto end;
+        }
+    }
 
     av_register_all();
     struct ffdec *ff = ffdec_open(
             arg->infilename, arg->audiostream, SAMPLERATE);
     if (!ff) goto end;
 
-    struct audiosplitter *sp = audiosplitter_create(
-            BLOCKLEN, SEGMENTMIN, SEGMENTMAX, getblock, ff);
+    if (arg->cache_dir)
+        cw = audiocache_writer_create(arg->cache_dir,
+                arg->infilename, arg->audiostream, SAMPLERATE, BLOCKLEN);
 
-    unsigned pos = 0;
-    struct audioblock *seg;
-    while ((seg = audiosplitter_next_segment(sp))) {
-        if (!aqueue_push(arg->segments, seg, pos++)) {
-            deletesegment(seg);
-            break;
+    timestamp_t duration = ffdec_duration(ff);
+    unsigned n = MIN(arg->n_threads, duration / DECODERANGE_MIN);
+
+    if (n <= 1) {
+        complete = split_segments(getblock, ff, arg->segments,
+                arg->silence_low, arg->silence_high, cw);
+        ffdec_close(ff);
+        arg->success = true;
+        goto end;
+    }
+
+    // decoders are opened in this thread, opening codecs is not thread-safe
+    struct decoderange_arg *ranges = xmalloc(sizeof *ranges * n);
+    for (unsigned i = 0; i < n; i++) {
+        ranges[i] = (struct decoderange_arg){0};
+        CHECK(!pthread_mutex_init(&ranges[i].mutex, NULL));
+        CHECK(!pthread_cond_init(&ranges[i].cond, NULL));
+    }
+
+    if (open_ranges(ranges, n, ff, duration, arg)) {
+
+        for (unsigned i = 0; i < n; i++)
+            CHECK(!pthread_create(&ranges[i].thread,
+                    NULL, decode_range, &ranges[i]));
+
+        // concatenate segments of all ranges
+        // spilled segments stay in the files of the range queues
+        bool aborted = false, failed = false;
+        for (unsigned i = 0; i < n && !aborted; i++) {
+            struct audiosegment *seg;
+            while ((seg = spillqueue_pop(ranges[i].segments, NULL))) {
+                if (cw) audiocache_writer_add(cw, seg);
+                if (!spillqueue_push(arg->segments, seg)) {
+                    audiosegment_delete(seg);
+                    aborted = true;
+                    break;
+                }
+            }
+            failed = spillqueue_error(ranges[i].segments);
+            aborted = aborted || failed;
+
+            // on failure of the consumer or of this range, stop all ranges
+            if (aborted)
+                for (unsigned j = i; j < n; j++)
+                    spillqueue_close(ranges[j].segments);
         }
+
+        for (unsigned i = 0; i < n; i++)
+            CHECK(!pthread_join(ranges[i].thread, NULL));
+
+        complete = !aborted;
+        arg->success = !failed;
     }
 
-    audiosplitter_delete(sp);
-    ffdec_close(ff);
-    arg->success = true;
+    for (unsigned i = 0; i < n; i++) {
+        if (ranges[i].ff) ffdec_close(ranges[i].ff);
+        if (ranges[i].segments)
+            spillqueue_delete(ranges[i].segments);
+        pthread_mutex_destroy(&ranges[i].mutex);
+        pthread_cond_destroy(&ranges[i].cond);
+    }
+    free(ranges);
+
 end:
-    aqueue_close(arg->segments);
+    if (cw) audiocache_writer_finish(cw, complete);
+    spillqueue_close(arg->segments);
     return NULL;
 }
 
 
+/*
+ * Pocketsphinx only reads models by file name. The generated models are
+ * handed over in anonymous memory files, opened through their /proc path.
+ */
+struct memfile {
+    FILE *file;
+    char path[32];
+};
+
+static bool memfile_open(struct memfile *mf, const char *name)
+{
+    int fd = memfd_create(name, 0);
+    if (fd < 0 || !(mf->file = fdopen(fd, "w+"))) {
+        error("Could not create memory file: %s", strerror(errno));
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    snprintf(mf->path, sizeof mf->path, "/proc/self/fd/%d", fd);
+    return true;
+}
+
+static void memfile_close(struct memfile *mf)
+{
+    if (mf->file) fclose(mf->file);
+}
+
+/*
+ * With time windows, segments starting in [k * window, (k + 1) * window)
+ * are decoded with window model k. It covers the subtitle words from one
+ * window before the window start to the end of the longest segment that
+ * starts in it, to allow for offsets between subtitle and audio times.
+ * Windows without words use the model of the whole subtitle file.
+ */
+struct window {
+    off_t offset;           // of the model in windowfile
+    size_t size;            // 0 if window has no words
+};
+
+struct models {
+    struct memfile lm;
+    struct memfile dict;    // pronunciation dictionary
+    struct memfile fsg;     // placeholder grammar in grammar mode
+
+    timestamp_t window;
+    unsigned nwindows;
+    struct memfile windowfile; // window models, one after the other
+    struct window *windows;
+};
+
+static void models_close(struct models *models)
+{
+    memfile_close(&models->lm);
+    memfile_close(&models->dict);
+    memfile_close(&models->fsg);
+    memfile_close(&models->windowfile);
+    free(models->windows);
+}
+
+/*
+ * The words of a window lie between two pointers into the subtitle list,
+ * which only move forward as the windows do: nodes before `first` end
+ * before the window, nodes from `stop` on (whose earliest start time is
+ * in `minstart`) start after it.
+ */
+static bool build_window_models(struct models *models,
+        const struct swlist *wl, timestamp_t window)
+{
+    timestamp_t end = 0;
+    timestamp_t *minstart = xmalloc((wl->length + 1) * sizeof *minstart);
+    FOREACH(struct swnode, node, wl->first, seq_next) {
+        end = MAX(end, node->maxendtime);
+        minstart[node->position] = node->minstarttime;
+    }
+    minstart[wl->length] = UINT32_MAX;
+    for (unsigned i = wl->length; i-- > 0;)
+        minstart[i] = MIN(minstart[i], minstart[i + 1]);
+
+    models->window = window;
+    models->nwindows = end / window + 1;
+    models->windows = xmalloc(models->nwindows * sizeof *models->windows);
+    if (!memfile_open(&models->windowfile, "windows")) {
+        free(minstart);
+        return false;
+    }
+
+    const struct swnode *first = wl->first, *stop = wl->first;
+    unsigned nused = 0;
+    bool success = true;
+    for (unsigned k = 0; k < models->nwindows && success; k++) {
+        timestamp_t start = k * window;
+        timestamp_t from = start > window ? start - window : 0;
+        timestamp_t to = start + window + SEGMENTMAX * BLOCKLEN * 1000 /
+                SAMPLERATE;
+
+        while (stop && minstart[stop->position] <= to)
+            stop = stop->seq_next;
+        while (first != stop && first->maxendtime < from)
+            first = first->seq_next;
+
+        struct window *w = &models->windows[k];
+        *w = (struct window){ .offset = ftello(models->windowfile.file) };
+
+        struct lmbuilder *lmb = lmbuilder_create();
+        if (lmbuilder_add_subnodes_range(lmb, first, stop, from, to)) {
+            lmbuilder_compute_model(lmb, 0.5f);
+            success = lmbuilder_write_dmp_file(lmb, models->windowfile.file,
+                    "window language model");
+            w->size = ftello(models->windowfile.file) - w->offset;
+            nused++;
+        }
+        lmbuilder_delete(lmb);
+    }
+
+    free(minstart);
+    if (success)
+        fprintf(stderr, "%u window language models\n", nused);
+    return success;
+}
+
+
+/*
+ * Builds the dictionary and the language model of the subtitle words. They
+ * are written to `dict` and, in binary format, to `lm`, and to the output
+ * files if they are given.
+ */
 static bool build_langmodel(const struct vsubalign_opt *opt,
-        struct dict *dict, struct swlist *wl)
+        struct dict *dict, struct swlist *wl, struct models *models)
 {
     bool success = false;
-    struct dict *srcdict = dict_create();
+    struct srcdict *srcdict = srcdict_open(opt->dic_infilename);
     struct lmbuilder *lmb = lmbuilder_create();
 
-    if (!dict_read(srcdict, opt->dic_infilename))
+    if (!srcdict)
         goto end;
 
     if (!subtitle_readwords(opt->subtitle_infilename, wl, dict, srcdict))
         goto end;
 
-    if (!dict_write(dict, opt->dic_outfilename))
+    if (opt->dic_outfilename && !dict_write(dict, opt->dic_outfilename))
         goto end;
 
     lmbuilder_add_subnodes(lmb, wl);
     lmbuilder_compute_model(lmb, 0.5f);
 
-    if (!lmbuilder_write_model(lmb, opt->lm_outfilename))
+    // alternative pronunciations must not become language model words, as
+    // they would with ps_add_word, so decoders read the whole dictionary
+    if (!dict_write_file(dict, models->dict.file, "dictionary") ||
+            !lmbuilder_write_dmp_file(lmb, models->lm.file, "language model"))
+        goto end;
+
+    if (opt->fsg_margin) {
+        // the decoder needs a grammar file, segments without words use it
+        fprintf(models->fsg.file, "FSG_BEGIN " PLACEHOLDER_GRAMMAR "\n"
+                "NUM_STATES 2\nSTART_STATE 0\nFINAL_STATE 1\n"
+                "TRANSITION 0 1 1.0 <sil>\nFSG_END\n");
+        if (fflush(models->fsg.file)) {
+            error("Could not write grammar: %s", strerror(errno));
+            goto end;
+        }
+    } else if (opt->lm_window &&
+            !build_window_models(models, wl, opt->lm_window))
+        goto end;
+
+    if (opt->lm_outfilename &&
+            !lmbuilder_write_model(lmb, opt->lm_outfilename))
         goto end;
 
+    if (opt->hashtable_report) {
+        dict_print_stats(dict, stderr);
+        lmbuilder_print_stats(lmb, stderr);
+    }
+
     success = true;
 end:
     lmbuilder_delete(lmb);
-    dict_delete(srcdict);
+    if (srcdict) srcdict_close(srcdict);
     return success;
 }
 
 
 
+static void deletelattice(void *ptr)
+{
+    lattice_delete(ptr);
+}
+
+
+static double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void print_init_stats(const char *what, const struct timespec *start)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(stderr, "%s: %.2f s, max rss %.1f MB\n",
+            what, seconds_since(start), usage.ru_maxrss / 1024.0);
+}
+
+
+/*
+ * Model files are memory-mapped if possible, so that the read-only model
+ * data of all decoders is shared.
+ */
+static cmd_ln_t *create_config(const struct vsubalign_opt *opt,
+        const struct models *models)
+{
+    cmd_ln_t *config = cmd_ln_init(NULL, ps_args(), TRUE,
+            "-hmm", opt->hmm_infilename,
+            opt->fsg_margin ? "-fsg" : "-lm",
+            opt->fsg_margin ? models->fsg.path : models->lm.path,
+            "-dict", models->dict.path,
+            "-mmap", "yes",
+            NULL);
+    if (!config) error("cmd_ln_init failed");
+    return config;
+}
+
+
 struct voicerec_arg
 {
     pthread_t thread;
     const struct vsubalign_opt *opt;
-    struct aqueue *segments;
+    const struct models *models;
+    const struct dict *dict;
+    const struct swlist *swlist; // for segment grammars
+    struct spillqueue *segments;
+    struct aqueue *lattices;
     bool success;
 };
 
 
+#define DEFAULT_LM_NAME "default" // name of the -lm model in the set
+
+/*
+ * Reads window model k. Pocketsphinx only reads models by file name, the
+ * model is copied from the shared file into a memory file of its own, which
+ * is closed again once the model is read.
+ */
+static ngram_model_t *read_window_model(ps_decoder_t *ps,
+        const struct models *models, unsigned k)
+{
+    const struct window *w = &models->windows[k];
+    char *buf = xmalloc(w->size);
+    struct memfile mf = {0};
+    ngram_model_t *lm = NULL;
+
+    if (pread(fileno(models->windowfile.file), buf, w->size, w->offset) !=
+            (ssize_t)w->size) {
+        error("Could not read window language model");
+        goto end;
+    }
+    if (!memfile_open(&mf, "window"))
+        goto end;
+    if (fwrite(buf, 1, w->size, mf.file) != w->size || fflush(mf.file)) {
+        error("Could not write window language model: %s", strerror(errno));
+        goto end;
+    }
+
+    lm = ngram_model_read(ps_get_config(ps), mf.path, NGRAM_AUTO,
+            ps_get_logmath(ps));
+    if (!lm) error("ngram_model_read failed");
+end:
+    memfile_close(&mf);
+    free(buf);
+    return lm;
+}
+
+/*
+ * Switches the decoder to the window model of a segment. Only the selected
+ * window model is kept in the decoder's model set, it is read again when a
+ * later segment needs it. `current` is the selected window, or -1 for the
+ * model of the whole file.
+ */
+static bool select_window_model(ps_decoder_t *ps, const struct models *models,
+        timestamp_t starttime, int *current)
+{
+    unsigned k = MIN(starttime / models->window, models->nwindows - 1);
+    int want = models->windows[k].size ? (int)k : -1;
+    if (want == *current) return true;
+
+    ngram_model_t *lmset = ps_get_lmset(ps);
+    char name[16], prevname[16];
+    snprintf(name, sizeof name, "window%d", want);
+    snprintf(prevname, sizeof prevname, "window%d", *current);
+
+    if (want >= 0) {
+        ngram_model_t *lm = read_window_model(ps, models, want);
+        if (!lm) return false;
+        ngram_model_set_add(lmset, lm, name, 1.0f, TRUE);
+    }
+
+    if (!ngram_model_set_select(lmset, want >= 0 ? name : DEFAULT_LM_NAME) ||
+            !ps_update_lmset(ps, lmset)) {
+        error("Could not switch language model");
+        return false;
+    }
+
+    if (*current >= 0)
+        ngram_model_free(ngram_model_set_remove(lmset, prevname, TRUE));
+    *current = want;
+    return true;
+}
+
+
+static bool decoder_has_word(const char *word, void *userptr)
+{
+    char *pron = ps_lookup_word(userptr, word);
+    ckd_free(pron);
+    return pron != NULL;
+}
+
+/*
+ * Replaces the decoder's grammar with the one of a segment, the previous
+ * grammar is removed from the set. Segments without subtitle words get the
+ * placeholder grammar, which only allows silence. Returns false on errors.
+ */
+static bool select_segment_grammar(ps_decoder_t *ps, const struct swlist *wl,
+        const struct audiosegment *segment, timestamp_t margin,
+        unsigned pos, char prevname[16])
+{
+    timestamp_t start = segment->blocks[0].starttime;
+    timestamp_t end = segment->blocks[segment->nblocks - 1].starttime +
+            segment->blocklen * 1000 / SAMPLERATE;
+
+    char name[16];
+    snprintf(name, sizeof name, "segment%u", pos);
+    fsg_model_t *fsg = grammar_create(wl, start > margin ? start - margin : 0,
+            end + margin, decoder_has_word, ps, name, ps_get_logmath(ps),
+            cmd_ln_float32_r(ps_get_config(ps), "-lw"));
+
+    // the set keeps the key pointer, NULL uses the name owned by the model
+    fsg_set_t *fsgs = ps_get_fsgset(ps);
+    if (!fsg) {
+        strcpy(name, PLACEHOLDER_GRAMMAR);
+    } else if (!fsg_set_add(fsgs, NULL, fsg)) {
+        error("Could not add grammar");
+        fsg_model_free(fsg);
+        return false;
+    }
+
+    if (!fsg_set_select(fsgs, name) || !ps_update_fsgset(ps)) {
+        error("Could not switch grammar");
+        if (fsg) fsg_model_free(fsg_set_remove_byname(fsgs,
+                fsg_model_name(fsg)));
+        return false;
+    }
+
+    if (*prevname)
+        fsg_model_free(fsg_set_remove_byname(fsgs, prevname));
+    strcpy(prevname, fsg ? name : "");
+    return true;
+}
+
+
 /*
  * voice recognition thread
+ * Pops segments in any order and pushes their lattices at the same position.
  */
 void *voicerec(void *ptr)
 {
@@ -136,58 +681,104 @@ void *voicerec(void *ptr)
     arg->success = false;
 
     ps_decoder_t *ps = NULL;
-    struct audioblock *segment = NULL;
+    struct audiosegment *segment = NULL;
+
+    const struct models *models = arg->models;
+    int current = -1;
+    char grammar[16] = "";
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    fprintf(stderr, "init ps...\n");
     err_set_logfp(NULL); // turn off pocketsphinx output, this is thread-specific
-    cmd_ln_t *config = cmd_ln_init(NULL, ps_args(), TRUE,
-            "-hmm", arg->opt->hmm_infilename,
-            "-lm", arg->opt->lm_outfilename,
-            "-dict", arg->opt->dic_outfilename,
-            NULL);
-    if (!config) { error("cmd_ln_init failed"); goto end; }
+    cmd_ln_t *config = create_config(arg->opt, arg->models);
+    if (!config) goto end;
 
     ps = ps_init(config);
+    cmd_ln_free_r(config);
     if (!ps) { error("ps_init failed"); goto end; }
 
-    fprintf(stderr, "init ps done\n");
+    print_init_stats("init decoder", &start);
+
+    int framerate = cmd_ln_int32_r(ps_get_config(ps), "-frate");
 
     unsigned pos;
-    while ((segment = aqueue_pop(arg->segments, &pos))) {
+    while ((segment = spillqueue_pop(arg->segments, &pos))) {
 
         fprintf(stderr, "process segment %u\n", pos);
+        if (models->nwindows && !select_window_model(ps, models,
+                segment->blocks[0].starttime, &current))
+            goto end;
+        if (arg->opt->fsg_margin && !select_segment_grammar(ps, arg->swlist,
+                segment, arg->opt->fsg_margin, pos, grammar))
+            goto end;
+
         if (ps_start_utt(ps, NULL) < 0) {
             error("ps_start_utt failed"); goto end;
         }
 
-        FOREACH(struct audioblock, block, segment, next) {
-            if (ps_process_raw(ps, block->samples, BLOCKLEN, 0, 0) < 0) {
-                error("ps_process_raw failed"); goto end;
-            }
+        if (ps_process_raw(ps, segment->samples,
+                segment->nblocks * segment->blocklen, FALSE, TRUE) < 0) {
+            error("ps_process_raw failed"); goto end;
         }
 
-        deletesegment(segment);
+        timestamp_t starttime = segment->blocks[0].starttime;
+        audiosegment_delete(segment);
         segment = NULL;
 
         if (ps_end_utt(ps) < 0) { error("ps_end_utt failed"); goto end; }
+        ps_get_prob(ps, NULL); // computes the link posteriors
 
         fprintf(stderr, "segment %u done\n", pos);
 
-        /*fprintf(stderr, "get lattice\n");
-        ps_lattice_t *pslat = ps_get_lattice(ps);
-        CHECK(pslat);
-        struct lattice *lat = lattice_create(pslat, 100, dict);
-        fprintf(stderr, "alignment\n");
-        alignment_add_lattice(alignment, lat);
-        fprintf(stderr, "alignment done\n");
-        lattice_delete(lat);*/
+        // lattice is empty if nothing was recognized
+        struct lattice *lat = lattice_create(ps_get_lattice(ps),
+                ps_get_logmath(ps), framerate, starttime, arg->dict);
+        if (!aqueue_push(arg->lattices, lat, pos)) {
+            lattice_delete(lat);
+            break;
+        }
     }
+    if (spillqueue_error(arg->segments)) goto end;
 
     arg->success = true;
 end:
-    aqueue_close(arg->segments);
+    spillqueue_close(arg->segments);
+    if (!arg->success) aqueue_close(arg->lattices);
     if (ps) ps_free(ps);
-    deletesegment(segment);
+    audiosegment_delete(segment);
+    return NULL;
+}
+
+
+
+struct align_arg
+{
+    struct swlist *swlist;
+    timestamp_t tolerance;
+    struct aqueue *lattices;
+};
+
+/*
+ * Alignment thread.
+ * Adds the lattices of all segments to the alignment, strictly in order.
+ */
+void *align(void *ptr)
+{
+    struct align_arg *arg = ptr;
+    struct alignment *al = alignment_create(arg->swlist, arg->tolerance);
+
+    unsigned pos;
+    struct lattice *lat;
+    while ((lat = aqueue_pop(arg->lattices, &pos))) {
+        fprintf(stderr, "align segment %u\n", pos);
+        alignment_add_lattice(al, lat);
+        lattice_delete(lat);
+    }
+
+    alignment_dump_final(al);
+    alignment_print_stats(al, stderr);
+    alignment_delete(al);
     return NULL;
 }
 
@@ -196,30 +787,50 @@ end:
 bool vsubalign(const struct vsubalign_opt *opt)
 {
     bool success = false;
-    struct aqueue *segments = aqueue_create(8);
+    // segments are buffered while the language model is prepared
+    struct spillqueue *segments = spillqueue_create(SEGMENTS_INMEMORY);
+    struct aqueue *lattices = aqueue_create(2 * opt->n_voicerec_threads);
     struct dict *dict = dict_create();
     struct swlist *swlist = swlist_create();
     struct voicerec_arg *voicerec_args = NULL;
+    pthread_t align_thread;
+    bool align_started = false;
+    struct models models = {0};
 
     // start decode thread
     struct decode_arg decode_arg = {
             .infilename = opt->video_infilename,
             .audiostream = opt->audiostream,
+            .n_threads = opt->n_decode_threads,
+            .silence_low = opt->silence_low,
+            .silence_high = opt->silence_high,
+            .cache_dir = opt->cache_dir,
             .segments = segments };
     pthread_t decode_thread;
     CHECK(!pthread_create(&decode_thread, NULL, decode, &decode_arg));
 
     // preparation for voice recognition
-    if (!build_langmodel(opt, dict, swlist)) {
-        aqueue_close(segments);
+    if (!memfile_open(&models.lm, "lm") ||
+            !memfile_open(&models.dict, "dict") ||
+            (opt->fsg_margin && !memfile_open(&models.fsg, "fsg")) ||
+            !build_langmodel(opt, dict, swlist, &models)) {
+        spillqueue_close(segments);
         goto end;
     }
 
+    // start alignment thread
+    struct align_arg align_arg = {
+            .swlist = swlist, .tolerance = opt->align_tolerance,
+            .lattices = lattices };
+    CHECK(!pthread_create(&align_thread, NULL, align, &align_arg));
+    align_started = true;
+
     // start voice recognition threads
     voicerec_args = xmalloc(sizeof *voicerec_args * opt->n_voicerec_threads);
     for (unsigned i = 0; i < opt->n_voicerec_threads; i++) {
         voicerec_args[i] = (struct voicerec_arg) {
-            .opt = opt, .segments = segments };
+            .opt = opt, .models = &models, .dict = dict, .swlist = swlist,
+            .segments = segments, .lattices = lattices };
         CHECK(!pthread_create(&voicerec_args[i].thread,
                 NULL, voicerec, &voicerec_args[i]));
     }
@@ -238,7 +849,14 @@ end:
         free(voicerec_args);
     }
 
-    aqueue_delete(segments, deletesegment);
+    // all lattices pushed, alignment thread finishes remaining ones
+    aqueue_close(lattices);
+    if (align_started)
+        CHECK(!pthread_join(align_thread, NULL));
+
+    models_close(&models);
+    spillqueue_delete(segments);
+    aqueue_delete(lattices, deletelattice);
     swlist_delete(swlist);
     dict_delete(dict);
 
@@ -10,9 +10,21 @@ struct vsubalign_opt {
     const char *subtitle_infilename;
     const char *hmm_infilename;
     const char *dic_infilename;
-    const char *dic_outfilename;
-    const char *lm_outfilename;
+    const char *dic_outfilename; // optional copies of the generated models,
+    const char *lm_outfilename;  // NULL if not needed
     unsigned n_voicerec_threads;
+    unsigned n_decode_threads;
+    float silence_low;   // thresholds for early segment splits, 0 disables
+    float silence_high;
+    const char *cache_dir; // decoded audio cache directory, NULL disables
+    bool hashtable_report; // print hash table statistics to stderr
+    timestamp_t lm_window; // per-segment models of the subtitle words
+                           // within this time (ms), 0 for one model
+    timestamp_t align_tolerance; // max. time (ms) between recognized words
+                                 // and their subtitles, 0 for any
+    timestamp_t fsg_margin; // grammar search with the subtitle words within
+                            // this time (ms) around each segment instead
+                            // of the language models, 0 disables
 };
 
 
@@ -16,12 +16,13 @@ static inline void le32(uint8_t buf[4], uint32_t n)
     buf[3] = n >> 24;
 }
 
-static void write_header(FILE *file, unsigned samplerate, unsigned nsamples)
+static void write_header(FILE *file, unsigned samplerate, unsigned nsamples,
+        uint32_t extrasize)
 {
     uint8_t header[11][4] = {{0}};
 
     memcpy(header[0], "RIFF", 4);
-    le32(header[1], nsamples * 2 + 36);
+    le32(header[1], nsamples * 2 + 36 + extrasize);
     memcpy(header[2], "WAVE", 4);
     memcpy(header[3], "fmt ", 4);
     header[4][0] = 16;
@@ -39,6 +40,7 @@ struct waveout {
     FILE *file;
     unsigned samplerate;
     unsigned nsamples;
+    uint32_t extrasize;     // size of chunks after the data chunk
 };
 
 waveout_t *waveout_open(const char *filename, unsigned samplerate)
@@ -49,7 +51,7 @@ waveout_t *waveout_open(const char *filename, unsigned samplerate)
         return NULL;
     }
 
-    write_header(file, samplerate, 0);
+    write_header(file, samplerate, 0, 0);
 
     waveout_t *wf = xmalloc(sizeof *wf);
     *wf = (waveout_t) {
@@ -64,6 +66,7 @@ waveout_t *waveout_open(const char *filename, unsigned samplerate)
 
 void waveout_write(waveout_t *wf, const int16_t *samples, unsigned nsamples)
 {
+    assert(wf->extrasize == 0);
     uint8_t buf[BUFLEN][2];
 
     wf->nsamples += nsamples;
@@ -78,18 +81,36 @@ void waveout_write(waveout_t *wf, const int16_t *samples, unsigned nsamples)
     }
 }
 
-void waveout_close(waveout_t *wf)
+void waveout_add_chunk(waveout_t *wf, const char id[4],
+        const void *data, uint32_t size)
 {
+    uint8_t header[2][4];
+    memcpy(header[0], id, 4);
+    le32(header[1], size);
+
+    fwrite(header, sizeof header, 1, wf->file);
+    fwrite(data, 1, size, wf->file);
+    if (size % 2) fputc(0, wf->file); // chunks are word aligned
+
+    wf->extrasize += sizeof header + size + size % 2;
+}
+
+bool waveout_close(waveout_t *wf)
+{
+    bool success = true;
     if (!fseek(wf->file, 0, SEEK_SET))
-        write_header(wf->file, wf->samplerate, wf->nsamples);
+        write_header(wf->file, wf->samplerate, wf->nsamples, wf->extrasize);
     else
         warning("Could not rewind WAVE file to rewrite header: %s", strerror(errno));
 
-    if (ferror(wf->file))
+    if (ferror(wf->file)) {
         error("Error while writing WAVE file");
+        success = false;
+    }
 
-    fclose(wf->file);
+    if (fclose(wf->file)) success = false;
     free(wf);
+    return success;
 }
 
 
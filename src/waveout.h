@@ -7,7 +7,13 @@ typedef struct waveout waveout_t;
 
 waveout_t *waveout_open(const char *filename, unsigned samplerate);
 void waveout_write(waveout_t *wf, const int16_t *samples, unsigned nsamples);
-void waveout_close(waveout_t *wf);
+
+// appends a chunk after the sample data, no more samples can be written
+void waveout_add_chunk(waveout_t *wf, const char id[4],
+        const void *data, uint32_t size);
+
+// returns false if there was a write error
+bool waveout_close(waveout_t *wf);
 
 
 #endif /* WAVEOUT_H_ */